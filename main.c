@@ -1,8 +1,27 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <float.h>
+#include <limits.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <threads.h>
+#include <time.h>
 #include <math.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <gmp.h>
+#include <zlib.h>
 
 #include "raylib.h"
 
@@ -11,12 +30,124 @@
 #define TEXTURE_BUFSIZE SCREEN_WIDTH*SCREEN_HEIGHT*sizeof(Color)
 #define MAX_ITERATIONS 100
 #define ZOOM_FACTOR 0.8
+#define PAN_STEP 32  // pixels per arrow key press
+#define ARENA_CAPACITY (16u << 20)
+#define ARENA_ALIGNMENT 64
+#define ARENA_COMMIT_STEP (64u << 10)
+#define MEMORY_SHRINKERS 8
+#define PIPELINE_DEPTH 2
+#define PROGRESS_SLOTS 64  // generations whose first pixels are timed, see progress_record()
+#define TILE_ARENA_CAPACITY (4u << 20)
+#define DEFAULT_TILE_SIZE 64
+#define PRECISION_MARGIN 1024.0L
+#define MIXED_MARGIN 64.0L  // what the first pass of --mixed-precision keeps to spare, see tile_fast_precision()
+#define MIXED_TOLERANCE 0.01  // estimated error in nu past which a pixel is recomputed
+#define CERTIFY_PERIOD 32  // longest cycle a trap is tried for, see disk_trapped()
+#define CERTIFY_MIN 16  // smallest part of a tile certify_tile() is tried on
+#define GLITCH_TOLERANCE 1e-6
+#define GLITCH_ROUNDS 32  // references tried per batch of glitched pixels, see perturb_rebase()
+#define DEEP_EXPONENT -900  // pixel spacings below 2^DEEP_EXPONENT need deep deltas
+#define RESCALE_LIMIT 0x1p64  // |w|^2 at which a rescaled delta is renormalized
+#define DEFAULT_ORBIT_BUDGET (256u << 20)
+#define DEFAULT_HISTORY_BUDGET (64u << 20)
+#define HISTORY_DEPTH 256  // views kept for undo and redo
+#define HISTORY_LEVEL 1  // zlib level of history snapshots
+#define HISTORY_CHUNK (256u << 10)  // bytes deflated between checks for a newer view
+#define ORBIT_CHUNK 256  // reference orbit entries published at a time while it is streamed
+#define TUNE_WIDTH 400
+#define TUNE_HEIGHT 300
+#define TUNE_REPEATS 3
+#define SHM_MAGIC 0x52465a4du  // "MZFR"
+#define SHM_VERSION 1
+#define SHM_SLOTS 4
+#define OUTPUT_BUFFERS 3
+#define PNG_LEVEL 1  // zlib level; past 1 the size barely drops and encoding gets much slower
+#define PNG_STRIP_BYTES (256u << 10)  // raw image data deflated per task
+#define PALETTE_SUBSTEPS 16
+#define COLORIZE_STRIP (1 << 16)
+#define COLORIZE_MERGE_BINS 256
+#define COLORIZE_LANES 4  // what SSE2 and NEON hold
+#define PROBE_WIDTH 32
+#define PROBE_HEIGHT 24
+#define PROBE_LIMIT_FACTOR 4
+#define MIN_ITERATIONS 64
+#define MARIANI_SILVER_MIN 6
+#define ROW_BAND 8
+#define SPLIT_AFTER 0.001  // seconds a task runs before it gives work to idle workers
+#define SPLIT_MIN_ROWS 4
+#define SPLIT_MAX_PARTS 16
+#define MAX_PIECES 256
+#define POINTS_BATCH 256
+#define DISTANCE_BAILOUT 1e20  // |z|^2 escaped points are iterated to for their distance
 
 typedef long double real_t;
 
+/* What memory is charged to in the global budget, see Memory. */
+typedef enum {
+  MEMORY_FRAMES,
+  MEMORY_TILES,
+  MEMORY_ORBITS,
+  MEMORY_TEXTURES,
+  MEMORY_EXPORT,
+  MEMORY_HISTORY,
+  MEMORY_COUNT,
+} MemoryKind;
+
+static const char* const memory_names[MEMORY_COUNT] = { "frames", "tiles", "orbits", "textures", "export",
+                                                        "history" };
+
+/* Gives back up to `wanted` bytes of what `context` holds but does not
+ * need right now, and returns how much it freed. It runs on whichever
+ * thread pushed the total over budget, so it must only touch memory
+ * that no other thread is using.
+ */
+typedef size_t (*MemoryShrink)(void* context, size_t wanted);
+
+/* Process-wide accounting of the memory every subsystem holds on to
+ * beyond a single call. Whenever a charge takes the total over `budget`
+ * the registered shrinkers are asked to make up the difference, before
+ * the process grows into the OOM killer on a shared host. A budget of 0
+ * is unlimited.
+ */
 typedef struct {
-  Color* front;
-  Color* back;
+  size_t budget;
+  _Atomic size_t used[MEMORY_COUNT];
+  _Atomic size_t peak[MEMORY_COUNT];
+  _Atomic size_t total;
+  _Atomic size_t total_peak;
+  // Held while shrinking, so only one thread evicts at a time.
+  mtx_t lock;
+  struct {
+    MemoryShrink shrink;
+    void* context;
+  } shrinkers[MEMORY_SHRINKERS];
+  int shrinker_count;
+  bool over_budget;
+} Memory;
+
+static Memory memory;
+
+/* Bump allocator for the short-lived scratch memory of a render job.
+ * Whoever runs a job owns an arena, carves whatever it needs for the
+ * job out of it and resets it once the job is over, so the render loop
+ * never goes through malloc/free. The high-water mark is kept to help
+ * sizing ARENA_CAPACITY. The capacity is only reserved address space:
+ * pages are charged to `kind` as the arena first reaches them, and
+ * arena_trim() hands them back.
+ */
+typedef struct {
+  char name[32];
+  MemoryKind kind;
+  unsigned char* base;
+  size_t capacity;
+  size_t used;
+  size_t peak;
+  size_t committed;
+} Arena;
+
+typedef struct {
+  int image_width;
+  int image_height;
   real_t width;
   real_t height;
   real_t center_real;
@@ -25,164 +156,6046 @@ typedef struct {
   real_t imag_min;
   real_t scalex;
   real_t scaley;
+  // The exact center; center_real/center_imag are its long double roundings.
+  mpf_t exact_real;
+  mpf_t exact_imag;
+} View;
+
+typedef struct RenderPool RenderPool;
+typedef struct Job Job;
+
+// A pool thread, with the scratch arena it resets for every task.
+typedef struct {
+  int id;
+  RenderPool* pool;
+  Arena arena;
+  // Whether a task is running, under the pool lock, and since when.
+  bool busy;
+  double task_start;
+  // Pixels this worker ran through a kernel, and how many of the
+  // perturbed ones needed a secondary reference; see pool_counters().
+  long long iterated;
+  long long rebased;
+  thrd_t thread;
+} Worker;
+
+/* A batch of independent tasks for the render pool. run() is called
+ * once for every task index in [0, task_count), on whichever worker
+ * picks it up. A running task may add more, see pool_add_tasks().
+ */
+struct Job {
+  void (*run)(Job* job, int task, Worker* worker);
+  void* context;
+  int task_count;
+  int next_task;
+  int tasks_done;
+  // Thread time its tasks took so far, under the pool lock.
+  double busy_time;
+  Job* next;
+};
+
+/* Fixed set of threads that executes jobs. Jobs are served first come
+ * first served, and several stages may have jobs in the pool at the same
+ * time.
+ */
+struct RenderPool {
+  int thread_count;
+  Worker* workers;
+  Job* jobs;
+  bool quit;
+  // Workers waiting for a task; the queue is empty while there are any.
+  atomic_int idle;
+  mtx_t lock;
+  cnd_t work;
+  cnd_t done;
+};
+
+typedef struct RenderJob RenderJob;
+
+/* Numeric backends, cheapest first. Picked per tile by tile_precision().
+ * Past long double, pixels are iterated as double deltas against an
+ * arbitrary precision reference orbit.
+ */
+typedef enum {
+  PRECISION_FLOAT,
+  PRECISION_DOUBLE,
+  PRECISION_LONG_DOUBLE,
+  PRECISION_PERTURBATION,
+  PRECISION_COUNT,
+} Precision;
+
+static const char* const precision_names[PRECISION_COUNT] = { "float", "double", "long-double", "perturbation" };
+
+/* How the pixels of a tile are found.
+ *   brute          - iterates every pixel
+ *   mariani-silver - iterates box borders and fills boxes whose border
+ *                    is all interior, see mariani_silver()
+ *   guessing       - iterates every other row and interpolates rows in
+ *                    between where their neighbours agree, see render_rows()
+ *   boundary       - iterates the boundaries between bands of equal
+ *                    iteration count and fills what they enclose, see
+ *                    boundary_trace()
+ * STRATEGY_AUTO probes the view and lets a cost model pick among the first
+ * three, see plan_frame().
+ */
+typedef enum {
+  STRATEGY_AUTO,
+  STRATEGY_BRUTE,
+  STRATEGY_MARIANI_SILVER,
+  STRATEGY_GUESSING,
+  STRATEGY_BOUNDARY,
+  STRATEGY_COUNT,
+} Strategy;
+
+static const char* const strategy_names[STRATEGY_COUNT] = {
+  "auto", "brute", "mariani-silver", "guessing", "boundary",
+};
+
+// Returns the strategy called `name`, or -1.
+int strategy_from_name(const char* name) {
+  for (int strategy = 0; strategy < STRATEGY_COUNT; ++strategy) {
+    if (strcmp(name, strategy_names[strategy]) == 0) {
+      return strategy;
+    }
+  }
+  return -1;
+}
+
+/* How a reference orbit is stored. |Z| stays below 2 until the
+ * reference escapes, so ORBIT_FLOAT halves the size for a relative error
+ * of about 6e-8 per entry, as long as no entry falls below float's normal
+ * range. That is not exact: a few pixels near band edges come out
+ * differently, by up to about 1e-5 in the smooth iteration count.
+ */
+typedef enum {
+  ORBIT_DOUBLE,
+  ORBIT_FLOAT,
+} OrbitFormat;
+
+/* Orbit of the reference point, rounded for the delta kernels. Z_n is
+ * (zr[n], zi[n]) in the arrays matching `format`. Z_0 .. Z_length are
+ * valid; once the orbit is complete, a length below the iteration limit
+ * means the reference itself escaped. Orbits over the memory budget
+ * live in a file mapping.
+ *
+ * A streamed orbit (see reference_stream()) is read while it is still
+ * being computed: length grows ORBIT_CHUNK entries at a time, and the
+ * kernels go through orbit_limit() to wait for more when they catch up.
+ */
+typedef struct {
+  OrbitFormat format;
+  double* zr;
+  double* zi;
+  float* zr_compact;
+  float* zi_compact;
+  _Atomic int length;
+  atomic_bool complete;
+  // Bumped whenever length or complete change; readers FUTEX_WAIT on it.
+  _Atomic int progress;
+  atomic_int waiters;
+  // Where the computation may stop, lowered once the frame's limit is known.
+  atomic_int target;
+  void* mapping;
+  size_t mapping_size;
+} ReferenceOrbit;
+
+// The thread that computes a streamed orbit, see reference_stream().
+typedef struct {
+  ReferenceOrbit* orbit;
+  mpf_srcptr cr;
+  mpf_srcptr ci;
+  int max_iterations;
+  bool threaded;
+  thrd_t thread;
+  double time;
+} ReferenceStream;
+
+// Iterates the pixels of [x0, x1) x [y0, y1) into job->nu.
+typedef void (*KernelFn)(const RenderJob* job, int x0, int y0, int x1, int y1);
+
+/* Where the delta iteration of each point picks up: after n[p]
+ * iterations, with delta (dzr[p], dzi[p]) and, when the derivative is
+ * carried, dz/dc = (dr[p], di[p]). Points with n[p] < 0 are already done
+ * and left alone.
+ */
+typedef struct {
+  int* n;
+  double* dzr;
+  double* dzi;
+  double* dr;
+  double* di;
+} PerturbStart;
+
+/* What the delta iteration finds for each point. nu and glitched are
+ * always filled in, the iteration count only when it is not NULL. With
+ * dr not NULL, dz/dc is carried along, and it and z are kept where the
+ * point stopped, for its distance; see point_finish().
+ */
+typedef struct {
+  float* nu;
+  uint8_t* glitched;
+  int* iterations;  // as in PointResults, and for glitched points where they stopped
+  double* zr;
+  double* zi;
+  double* dr;
+  double* di;
+} PerturbResults;
+
+/* Iterates `count` points given as offsets dc from the reference point,
+ * from dz = 0 or from `start` if there is one. Points whose delta can no
+ * longer be trusted are flagged in `glitched` and need another reference.
+ */
+typedef void (*PerturbFn)(const ReferenceOrbit* ref, const double* dcr, const double* dci,
+                          const PerturbStart* start, int count, int max_iterations,
+                          const PerturbResults* results);
+
+/* For views too deep for the offsets to fit a double, given as
+ * dc * 2^-exponent instead: iterates the points until their delta fits
+ * a double, and leaves them in `start` for a PerturbFn to finish.
+ */
+typedef void (*PerturbDeepFn)(const ReferenceOrbit* ref, const double* dcr, const double* dci, int exponent,
+                              int count, int max_iterations, const PerturbResults* results,
+                              PerturbStart* start);
+
+/* How deltas below the range of double are iterated.
+ *   rescaled - a double and a per-pixel power of two, renormalized when
+ *              the double drifts, see perturb_rescaled()
+ *   floatexp - a double mantissa with its own exponent for every number,
+ *              see perturb_floatexp()
+ * Both are picked by --tune, which benchmarks one against the other.
+ */
+typedef enum {
+  DEEP_RESCALED,
+  DEEP_FLOATEXP,
+  DEEP_DELTAS_COUNT,
+} DeepDeltas;
+
+static const char* const deep_deltas_names[DEEP_DELTAS_COUNT] = { "rescaled", "floatexp" };
+
+/* Arbitrary points to evaluate, for callers that have no grid of pixels,
+ * as separate arrays of real and imaginary parts. With PRECISION_PERTURBATION
+ * they are offsets from (reference_real, reference_imag), where `reference`
+ * starts, otherwise the points themselves.
+ */
+typedef struct {
+  const real_t* real;
+  const real_t* imag;
+  int count;
+  Precision precision;
+  const ReferenceOrbit* reference;
+  mpf_srcptr reference_real;
+  mpf_srcptr reference_imag;
+} PointSet;
+
+/* What is found for each point of a PointSet; outputs left NULL are
+ * skipped. With perturbation, points whose delta went wrong are rebased
+ * on other references as in render, and a distance too small for a
+ * float comes out as 0.
+ */
+typedef struct {
+  int* iterations;  // until |z| > 2, -1 for points that stay
+  float* nu;        // smooth escape value as in render, -1 for points that stay
+  float* distance;  // estimated distance to the set, 0 for points that stay
+} PointResults;
+
+// Evaluates points [first, first + count) of `points`.
+typedef void (*PointsFn)(const PointSet* points, int first, int count, int max_iterations,
+                         const PointResults* results);
+
+typedef struct {
+  const char* name;
+  bool (*available)(void);  // NULL if it runs everywhere
+  KernelFn render[PRECISION_PERTURBATION];
+  PerturbFn perturb;
+  PointsFn points[PRECISION_PERTURBATION];
+} Kernel;
+
+/* Whether a slow task gives part of its tile to idle workers, see
+ * split_wanted(). Only --conformance forces it, to check that the frame
+ * comes out the same either way.
+ */
+typedef enum {
+  SPLIT_IDLE,    // when a worker is idle and the task has run a while
+  SPLIT_NEVER,
+  SPLIT_ALWAYS,  // at every chance, for as many parts as allowed
+} SplitPolicy;
+
+// Knobs that depend on the machine, see --tune.
+typedef struct {
+  int kernel;
+  int tile_size;
+  int threads;
+  // Reference orbit storage, see OrbitFormat.
+  bool compact_orbit;
+  size_t orbit_budget;
+  Strategy strategy;
+  DeepDeltas deep_deltas;
+  bool mixed_precision;
+  bool certify;
+  SplitPolicy split;
+} Settings;
+
+typedef struct State State;
+
+typedef enum {
+  COLORING_HISTOGRAM,  // hue follows the share of pixels that escape sooner
+  COLORING_CYCLE,      // hue cycles every 36 iterations
+} Coloring;
+
+/* The colorize passes over a frame, run on the render pool. Pixels are
+ * counted into one histogram per worker, so no two threads touch the
+ * same counter; the merge then sums them up bin range by bin range.
+ * Both colorings end in a palette indexed by the escape value, so the
+ * final pass is a lookup per pixel.
+ */
+typedef struct {
+  const float* nu;
+  Color* pixels;
+  int count;
+  // Bin b holds the pixels with b <= nu + 1 < b + 1.
+  int bins;
+  int workers;
+  // Per worker, COLORIZE_LANES counters for each bin and for the interior.
+  uint32_t* histograms;
+  uint32_t* counts;
+  // Entry 0 is the interior, entry 1 + k covers k <= (nu + 1) * PALETTE_SUBSTEPS < k + 1.
+  Color* palette;
+  int palette_size;
+  // With `latest`, the map gives up once *latest is no longer `generation`.
+  const _Atomic uint64_t* latest;
+  uint64_t generation;
+} ColorizeJob;
+
+/* Part of a tile that a slow task gave away to idle workers, see
+ * render_split(). Rows are rendered with the job's strategy; a box has
+ * its border done already and is handed to mariani_silver().
+ */
+typedef struct {
+  int x0, y0, x1, y1;
+  Precision precision;
+  bool box;
+  // Rows of the area the rows were cut from, which set the ones guessing iterates.
+  int top, bottom;
+} TilePiece;
+
+// The pieces given away and not taken yet, see render_hand_off().
+typedef struct {
+  mtx_t lock;
+  int count;
+  TilePiece pieces[MAX_PIECES];
+} PieceStack;
+
+struct RenderJob {
+  View view;
+  int max_iterations;
+  Strategy strategy;
+  int tile_size;
+  int tiles_x;
+  int tile_count;
+  // Tasks past tile_count each take one of the pieces, whichever is on top.
+  Job* pool_job;
+  PieceStack* pieces;
+  SplitPolicy split;
+  const Kernel* kernel;
+  const ReferenceOrbit* reference;
+  OrbitFormat orbit_format;
+  size_t orbit_budget;
+  DeepDeltas deep_deltas;
+  float* nu;
+  // Pixels of nu that are already rendered, see render_margin().
+  int skip_x0, skip_y0, skip_x1, skip_y1;
+  /* With --mixed-precision, a flag per pixel of nu for the ones to
+   * recompute, see refine_run(); NULL otherwise. refined counts them.
+   */
+  uint8_t* sensitive;
+  _Atomic long long refined;
+  // Whether tiles are first tried with certify_tile(), and how many pixels it filled.
+  bool certify;
+  _Atomic long long certified;
+  // Thread time of its tasks, refinement included, set by render_job_run().
+  double busy_time;
+  // Once set, the tasks that are left return right away.
+  atomic_bool* cancel;
+  // Set when rendering for the viewer, to report the first finished tile.
+  State* state;
+  uint64_t generation;
+  atomic_bool first_tile_done;
+};
+
+/* Where a view is in whole pixels from the first one, counting pans
+ * only. Two views with the same number of zooms are pixel grids shifted
+ * by the difference, which is what lets a guard frame stand in for a
+ * panned view.
+ */
+typedef struct {
+  long long x;  // positive when the view moved right
+  long long y;  // positive when the view moved down
+  uint64_t zooms;
+} PanPosition;
+
+/* Where the time of a frame went, for --metrics. render_view() fills
+ * in the iterate side; whoever colors the frame adds colorize_time.
+ */
+typedef struct {
+  Precision precision;
+  Strategy strategy;
+  int max_iterations;
+  int reference_length;  // 0 without perturbation
+  // Pixels run through a kernel; the strategy filled in the others.
+  long long iterated;
+  long long rebased;
+  // Of the iterated, how many --mixed-precision iterated a second time.
+  long long refined;
+  // Of the filled, how many --certify filled by whole tiles.
+  long long certified;
+  // Taken from the zoom history instead of rendered; the counts are the original render's.
+  bool restored;
+  double reference_time;
+  double plan_time;
+  double iterate_time;
+  // Summed over the render tasks of the pool's workers.
+  double busy_time;
+  double colorize_time;
+} FrameMetrics;
+
+// The JSON Lines file of --metrics, one record per frame.
+typedef struct {
+  FILE* file;
+  char host[256];  // escaped for a JSON string
+  uint64_t frames;
+} MetricsLog;
+
+/* A frame on its way from the iterate stage to the colorize stage.
+ * The slot's arena holds everything the frame needs and is reset when
+ * the iterate stage picks the slot up for a new frame.
+ */
+typedef struct {
+  Arena arena;
+  uint64_t generation;
+  int max_iterations;
+  float* nu;
+  // A guard frame: the view widened by the overscan margin, see iterate_stage().
+  bool guard;
+  PanPosition position;
+  View view;
+  FrameMetrics metrics;
+} FrameSlot;
+
+/* Bounded queue of frames between the iterate and colorize stages.
+ * A slot is only handed back to the producer once the consumer has
+ * finished with it, so at most PIPELINE_DEPTH frames are in flight.
+ */
+typedef struct {
+  FrameSlot slots[PIPELINE_DEPTH];
+  int head;
+  int count;
+  // Whether the producer holds the slot after the queued ones.
+  bool reserved;
+  mtx_t lock;
+  cnd_t changed;
+} FrameQueue;
+
+/* Header of the shared-memory frame ring exported with --shm. The
+ * frames follow the header, slot_size bytes apart, starting at
+ * header_size. Slot i holds frame number n with sequence 2n+2 once it is
+ * complete and 2n+1 while it is being written, so a reader can check the
+ * sequence before and after using a frame in place. Every publish bumps
+ * `futex`, which readers can FUTEX_WAIT on.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  uint32_t format;  // 0 = RGBA8
+  uint32_t slot_count;
+  uint32_t header_size;
+  uint64_t slot_size;
+  _Atomic uint32_t futex;
+  uint32_t reserved;
+  _Atomic uint64_t published;  // frames so far, the latest is in slot (published - 1) % slot_count
+  struct {
+    _Atomic uint64_t sequence;
+    uint64_t generation;
+    double timestamp;
+  } slots[SHM_SLOTS];
+} ShmHeader;
+
+typedef struct {
+  char name[64];
+  ShmHeader* header;
+  unsigned char* frames;
+  size_t size;
+} ShmExport;
+
+/* Just enough of io_uring for the output stage, through the raw
+ * syscalls: one ring that file writes are submitted to. ring_fd is -1
+ * where the kernel (or a seccomp filter) does not allow io_uring; writes
+ * then block the output stage instead.
+ */
+typedef struct {
+  int ring_fd;
+  _Atomic unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  _Atomic unsigned* cq_head;
+  _Atomic unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+} IoRing;
+
+typedef enum {
+  OUTPUT_FREE,     // the render thread may fill it
+  OUTPUT_QUEUED,   // waiting for the output stage
+  OUTPUT_WRITING,  // encoded, its write is in flight
+} OutputState;
+
+/* A frame on its way from a headless render to disk. The render thread
+ * colors it into `pixels`; the output stage encodes it into `file` and
+ * writes that out, after which the buffer is free again.
+ */
+typedef struct {
+  OutputState state;
+  Color* pixels;
+  char path[512];
+  unsigned char* file;
+  size_t file_size;
+  size_t file_capacity;
+  size_t written;
+  int fd;
+  double write_start;
+} OutputBuffer;
+
+/* Bounded ring of frames between a headless render and the output
+ * stage. The render thread only waits when all OUTPUT_BUFFERS are still
+ * being encoded or written, so a slow disk holds back the render instead
+ * of piling up frames in memory, and a fast one never shows up in it.
+ */
+typedef struct {
+  OutputBuffer buffers[OUTPUT_BUFFERS];
+  int width;
+  int height;
+  int next_fill;    // the render thread's next buffer
+  int next_encode;  // the output stage's next buffer
+  int in_flight;    // writes submitted and not completed, output stage only
+  bool closing;
+  IoRing ring;
+  // Encoding runs on the render pool, with its bookkeeping in `scratch`.
+  RenderPool* pool;
+  Arena scratch;
+  mtx_t lock;
+  cnd_t changed;
+  // Totals for the report, written by the output stage only.
+  int frames;
+  int failed;
+  uint64_t bytes;
+  double encode_time;
+  double write_time;
+  uint64_t encoded_bytes;  // raw image data
+} OutputQueue;
+
+/* A PNG encode split into strips of rows, one pool task each. Every
+ * strip is deflated on its own into a region of the file big enough for
+ * any outcome, and the regions are packed together afterwards.
+ */
+typedef struct {
+  const unsigned char* pixels;
+  int width;
+  int height;
+  int strip_rows;
+  unsigned char* out;
+  size_t* offsets;    // of each strip's region in out
+  size_t* bounds;     // size of each region
+  size_t* sizes;      // deflated size of each strip
+  uLong* checksums;   // adler32 of each strip's raw data
+  atomic_bool failed;
+} PngJob;
+
+/* A view the viewer has been at, for undo and redo. `snapshot` is its
+ * last frame as deflated byte planes of nu (see history_store()), or
+ * NULL when the frame never got that far or was evicted.
+ */
+typedef struct {
+  View view;
+  uint64_t generation;  // the latest time it was made current
+  unsigned char* snapshot;
+  size_t snapshot_size;
+  int max_iterations;
+  FrameMetrics metrics;
+} HistoryEntry;
+
+/* The views zoomed through, oldest first, in a ring of HISTORY_DEPTH.
+ * Entries before `current` are what undo goes back to, those after it
+ * what redo goes forward to; pans change the current entry in place.
+ * Snapshots are kept to `budget` bytes by evicting the ones furthest
+ * from the current entry, which keep their view and are rendered again.
+ * The iterate stage alone uses the staging buffers, the lock guards the
+ * rest.
+ */
+typedef struct {
+  HistoryEntry entries[HISTORY_DEPTH];
+  int first;
+  int count;
+  int current;  // counted from first
+  size_t budget;
+  size_t used;
+  size_t pixels;
+  unsigned char* planes;    // nu split into byte planes
+  unsigned char* deflated;  // room for the worst case
+  size_t deflated_capacity;
+  mtx_t lock;
+} History;
+
+// When the first tile of a generation was computed.
+typedef struct {
+  _Atomic uint64_t generation;
+  _Atomic double time;
+} ProgressMark;
+
+struct State {
+  Color* front;
+  Color* back;
+  uint64_t front_generation;
+  // Where the front and back frames were rendered, swapped along with them.
+  View front_view;
+  View back_view;
+  // The latest colored guard frame, swapped like front/back, and the
+  // overscan margin on each side (0 without --overscan).
+  Color* guard_front;
+  Color* guard_back;
+  PanPosition guard_position;
+  atomic_bool guard_ready;
+  int margin_x;
+  int margin_y;
+  View view;
+  PanPosition position;
+  uint64_t generation;
+  FrameQueue frames;
   atomic_bool dirty;
   atomic_bool ready;
-  bool quit;
+  atomic_bool quit;
+  mtx_t view_lock;
+  cnd_t view_changed;
   mtx_t swap_lock;
-} State;
+  cnd_t uploaded;
+  ShmExport* shm;
+  MetricsLog* metrics;
+  RenderPool* pool;
+  Settings settings;
+  Coloring coloring;
+  History history;
+  // The latest frame handed to the colorize stage, guard frames aside.
+  _Atomic uint64_t pushed_generation;
+  // Latest frame whose first tile has been computed, and when each of
+  // the last PROGRESS_SLOTS were, by generation modulo PROGRESS_SLOTS.
+  _Atomic uint64_t progress_generation;
+  ProgressMark progress[PROGRESS_SLOTS];
+};
 
-real_t mandelbrot(real_t cr, real_t ci, int max_iterations) {
-  /* Mandelbrot set formula:
-   * z(n+1) = z(n)**2 + c, where z(0) = 0
-   */
+typedef enum {
+  INPUT_CLICK,
+  INPUT_SCROLL,
+  INPUT_PAN,
+  INPUT_UNDO,
+  INPUT_REDO,
+  INPUT_COUNT,
+} InputKind;
 
-  real_t zr = 0.0L;
-  real_t zi = 0.0L;
-  
-  for (int i = 0; i < max_iterations; ++i) {
-    real_t zr_new = zr * zr - zi * zi + cr;
-    zi = 2 * zr * zi + ci;
-    zr = zr_new;
+static const char* const input_names[INPUT_COUNT] = { "click", "scroll", "pan", "undo", "redo" };
 
-    real_t zabs_squared = zr * zr + zi * zi;
-    // Instead of taking sqrt(z) and comparing with 2.0,
-    // we work on z**2 and compare with 4.0.
-    if (zabs_squared > 4.0L) {
-      /* nu is an approximation of the Green's function, which
-       * reflects how fast the iteration escapes to infinity.
-       */
-      real_t nu = (real_t)i  + 1.0L - log2l(log2l(zabs_squared));
-      return nu;
+typedef struct {
+  double time;  // seconds since the first frame was on screen
+  InputKind kind;
+  // The cursor, or for a pan how many pixels the view moves right and down.
+  float x;
+  float y;
+  float amount;  // wheel steps, positive zooms in
+} InputEvent;
+
+typedef struct {
+  uint64_t generation;
+  double input;
+  double first_pixels;
+  double on_screen;
+} LatencySample;
+
+/* A scripted input session played back against the viewer. Every
+ * event is timestamped at its scheduled time, and the sample is closed
+ * once a frame that includes it makes it to the screen.
+ */
+typedef struct {
+  InputEvent* events;
+  LatencySample* samples;
+  int count;
+  int next;
+  double start;
+} Replay;
+
+void memory_init(void) {
+  mtx_init(&memory.lock, mtx_plain);
+}
+
+void memory_register(MemoryShrink shrink, void* context) {
+  mtx_lock(&memory.lock);
+  if (memory.shrinker_count == MEMORY_SHRINKERS) {
+    // A shrinker left out would quietly hold on to its memory past the budget.
+    fprintf(stderr, "[MEMORY] More than %d shrinkers, raise MEMORY_SHRINKERS\n", MEMORY_SHRINKERS);
+    abort();
+  }
+  memory.shrinkers[memory.shrinker_count].shrink = shrink;
+  memory.shrinkers[memory.shrinker_count].context = context;
+  memory.shrinker_count++;
+  mtx_unlock(&memory.lock);
+}
+
+void memory_unregister(void* context) {
+  mtx_lock(&memory.lock);
+  for (int i = 0; i < memory.shrinker_count; ++i) {
+    if (memory.shrinkers[i].context == context) {
+      memory.shrinkers[i] = memory.shrinkers[--memory.shrinker_count];
+      break;
     }
   }
-  return -1.0L;
+  mtx_unlock(&memory.lock);
 }
 
-int worker(void* arg) {
-  State* state = arg;
-  while(!state->quit) {
-    if (!atomic_load(&state->dirty)) {
-      thrd_yield();
-      continue;
+// What can still be charged before the budget runs out.
+size_t memory_headroom(void) {
+  size_t total = atomic_load(&memory.total);
+  if (memory.budget == 0) {
+    return SIZE_MAX;
+  }
+  return total < memory.budget ? memory.budget - total : 0;
+}
+
+static void memory_raise_peak(_Atomic size_t* peak, size_t value) {
+  size_t seen = atomic_load(peak);
+  while (seen < value && !atomic_compare_exchange_weak(peak, &seen, value)) {
+  }
+}
+
+void memory_release(MemoryKind kind, size_t size) {
+  atomic_fetch_sub(&memory.used[kind], size);
+  atomic_fetch_sub(&memory.total, size);
+}
+
+// Charges `size` to `kind`, shrinking the others if that goes over budget. See memory_charge().
+static bool memory_charge_shrinking(MemoryKind kind, size_t size, bool reserve) {
+  size_t used = atomic_fetch_add(&memory.used[kind], size) + size;
+  size_t total = atomic_fetch_add(&memory.total, size) + size;
+  bool fits = memory.budget == 0 || total <= memory.budget;
+  if (!fits) {
+    mtx_lock(&memory.lock);
+    for (int i = 0; i < memory.shrinker_count && atomic_load(&memory.total) > memory.budget; ++i) {
+      memory.shrinkers[i].shrink(memory.shrinkers[i].context, atomic_load(&memory.total) - memory.budget);
+    }
+    total = atomic_load(&memory.total);
+    fits = total <= memory.budget;
+    if (!fits && reserve) {
+      memory_release(kind, size);
+      mtx_unlock(&memory.lock);
+      return false;
+    }
+    if (!fits && !memory.over_budget) {
+      fprintf(stderr, "[MEMORY] Over budget: %.1f of %.1f MB held after shrinking\n",
+              total / 1048576.0, memory.budget / 1048576.0);
     }
+    memory.over_budget = !fits;
+    mtx_unlock(&memory.lock);
+  }
+  memory_raise_peak(&memory.peak[kind], used);
+  memory_raise_peak(&memory.total_peak, total);
+  return fits;
+}
+
+/* Records `size` more bytes held by `kind`. The memory is already
+ * committed by the time it is charged, so this never refuses; it
+ * shrinks the others to make room and returns whether that was enough.
+ * Memory that can be done without goes through memory_reserve().
+ */
+bool memory_charge(MemoryKind kind, size_t size) {
+  return memory_charge_shrinking(kind, size, false);
+}
+
+/* Charges `size` bytes that are not allocated yet, if they fit within
+ * the budget once the others have been shrunk. Returns false, charging
+ * nothing, if they do not; the caller then goes without.
+ */
+bool memory_reserve(MemoryKind kind, size_t size) {
+  return memory_charge_shrinking(kind, size, true);
+}
+
+void memory_report(void) {
+  for (int kind = 0; kind < MEMORY_COUNT; ++kind) {
+    printf("[MEMORY] %-8s: peak %8.2f MB, %8.2f MB held\n", memory_names[kind],
+           atomic_load(&memory.peak[kind]) / 1048576.0, atomic_load(&memory.used[kind]) / 1048576.0);
+  }
+  if (memory.budget == 0) {
+    printf("[MEMORY] total   : peak %8.2f MB, no budget\n", atomic_load(&memory.total_peak) / 1048576.0);
+  } else {
+    printf("[MEMORY] total   : peak %8.2f MB of %.2f MB budget\n", atomic_load(&memory.total_peak) / 1048576.0,
+           memory.budget / 1048576.0);
+  }
+}
 
-    int max_iterations = 64 + 4 * log10l(1.0L / state->width);
+void arena_init(Arena* arena, const char* name, MemoryKind kind, size_t capacity) {
+  snprintf(arena->name, sizeof(arena->name), "%s", name);
+  arena->kind = kind;
+  // Anonymous pages are only backed once touched, and can be dropped again.
+  void* base = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  arena->base = base != MAP_FAILED ? base : NULL;
+  arena->capacity = capacity;
+  arena->used = 0;
+  arena->peak = 0;
+  arena->committed = 0;
+}
 
-    for (int y = 0; y < SCREEN_HEIGHT; ++y) {
-      real_t imag = state->scaley * ((real_t)(SCREEN_HEIGHT-y-1) + 0.5L) + state->imag_min;
+void* arena_alloc(Arena* arena, size_t size) {
+  uintptr_t start = (uintptr_t)arena->base;
+  uintptr_t aligned = (start + arena->used + ARENA_ALIGNMENT - 1) & ~(uintptr_t)(ARENA_ALIGNMENT - 1);
+  size_t offset = aligned - start;
 
-      for (int x = 0; x < SCREEN_WIDTH; ++x) {
-        real_t real = state->scalex * ((real_t)x + 0.5L) + state->real_min;
+  if (arena->base == NULL || offset + size > arena->capacity) {
+    // Running out of scratch is a sizing bug, not something to recover from.
+    fprintf(stderr, "[ARENA] %s: out of memory (%zu bytes requested, %zu of %zu used)\n",
+            arena->name, size, arena->used, arena->capacity);
+    abort();
+  }
 
-        real_t nu = mandelbrot(real, imag, max_iterations);
+  arena->used = offset + size;
+  if (arena->used > arena->peak) {
+    arena->peak = arena->used;
+  }
+  if (arena->used > arena->committed) {
+    size_t committed = (arena->used + ARENA_COMMIT_STEP - 1) / ARENA_COMMIT_STEP * ARENA_COMMIT_STEP;
+    committed = committed < arena->capacity ? committed : arena->capacity;
+    size_t grown = committed - arena->committed;
+    arena->committed = committed;
+    memory_charge(arena->kind, grown);
+  }
+  return arena->base + offset;
+}
 
-        if (nu > -1.0L) {
-          int color = nu * 10.0L;
-          state->back[y * SCREEN_WIDTH + x] = ColorFromHSV(color, 0.8f, 0.8f);
-        } else {
-          state->back[y * SCREEN_WIDTH + x] = BLACK;
-        }
-      }
-    }
-    // TODO: should this be here?
-    atomic_store(&state->ready, false);
-    mtx_lock(&state->swap_lock);
-    // Swap buffers
-    Color* tmp = state->front;
-    state->front = state->back;
-    state->back = tmp;
-    mtx_unlock(&state->swap_lock);
+size_t arena_available(const Arena* arena) {
+  // Keep the worst case alignment padding out of what is promised.
+  size_t used = arena->used + ARENA_ALIGNMENT;
+  return used < arena->capacity ? arena->capacity - used : 0;
+}
 
-    atomic_store(&state->ready, true);
-    atomic_store(&state->dirty, false);
+// Where the arena is filled up to, for arena_rewind().
+size_t arena_mark(const Arena* arena) {
+  return arena->used;
+}
+
+// Gives back everything allocated since arena_mark() returned `mark`.
+void arena_rewind(Arena* arena, size_t mark) {
+  arena->used = mark;
+}
+
+void arena_reset(Arena* arena) {
+  arena->used = 0;
+}
+
+// Gives the pages past what is in use back to the system, returns how many bytes.
+size_t arena_trim(Arena* arena) {
+  size_t keep = (arena->used + ARENA_COMMIT_STEP - 1) / ARENA_COMMIT_STEP * ARENA_COMMIT_STEP;
+  if (keep >= arena->committed) {
+    return 0;
   }
-  printf("[WORKER] Done\n");
-  return 0;
+  size_t freed = arena->committed - keep;
+  madvise(arena->base + keep, freed, MADV_DONTNEED);
+  arena->committed = keep;
+  memory_release(arena->kind, freed);
+  return freed;
 }
 
-int main(void) {
-  InitWindow(SCREEN_WIDTH, SCREEN_HEIGHT, "MZOOM");
+void arena_report(const Arena* arena) {
+  printf("[ARENA] %s: peak %zu of %zu bytes\n", arena->name, arena->peak, arena->capacity);
+}
 
-  SetTargetFPS(30);
+void arena_free(Arena* arena) {
+  if (arena->base != NULL) {
+    munmap(arena->base, arena->capacity);
+    memory_release(arena->kind, arena->committed);
+  }
+  arena->base = NULL;
+  arena->committed = 0;
+}
 
-  /* Mandelbrot lives in [-2, 2]/[-2, 2] square, so we need
-   * to map screen coordinates to is. However, for a prettier
-   * more centered image it is recommended to use:
-   * - [-2.0, 1.0] for the real part
-   * - [-1.5, 1.5] for the imaginary
-   */
-  Texture2D texture = LoadTextureFromImage(GenImageColor(SCREEN_WIDTH, SCREEN_HEIGHT, BLACK));
+/* Mandelbrot set formula:
+ * z(n+1) = z(n)**2 + c, where z(0) = 0
+ *
+ * The loop is instantiated once per numeric backend, see Precision.
+ */
+#define DEFINE_MANDELBROT(name, type, log2fn)                                 \
+  type name(type cr, type ci, int max_iterations) {                           \
+    type zr = 0;                                                              \
+    type zi = 0;                                                              \
+                                                                              \
+    for (int i = 0; i < max_iterations; ++i) {                                \
+      type zr_new = zr * zr - zi * zi + cr;                                   \
+      zi = 2 * zr * zi + ci;                                                  \
+      zr = zr_new;                                                            \
+                                                                              \
+      type zabs_squared = zr * zr + zi * zi;                                  \
+      /* Instead of taking sqrt(z) and comparing with 2.0,                    \
+       * we work on z**2 and compare with 4.0.                                \
+       */                                                                     \
+      if (zabs_squared > 4) {                                                 \
+        /* nu is an approximation of the Green's function, which              \
+         * reflects how fast the iteration escapes to infinity.               \
+         */                                                                   \
+        return (type)i + 1 - log2fn(log2fn(zabs_squared));                    \
+      }                                                                       \
+    }                                                                         \
+    return -1;                                                                \
+  }
 
-  real_t width = 3.0L;
-  real_t height = width * ((real_t)SCREEN_HEIGHT / SCREEN_WIDTH);
-  real_t center_real = -0.5L;
-  real_t center_imag = 0.0L;
+DEFINE_MANDELBROT(mandelbrot, real_t, log2l)
+DEFINE_MANDELBROT(mandelbrot_double, double, log2)
+DEFINE_MANDELBROT(mandelbrot_float, float, log2f)
 
-  State state = {
-    .width = width,
-    .height = height,
-    .center_real = center_real,
-    .center_imag = center_imag,
-    .real_min = center_real - width * 0.5L,
-    .imag_min = center_imag - height * 0.5L,
-    .scalex = width / (real_t)SCREEN_WIDTH,
-    .scaley = height / (real_t)SCREEN_HEIGHT,
-    .front = MemAlloc(TEXTURE_BUFSIZE),
-    .back =  MemAlloc(TEXTURE_BUFSIZE),
-    .dirty = ATOMIC_VAR_INIT(true),
-    .ready = ATOMIC_VAR_INIT(false),
-    .quit = false,
+double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+bool shm_export_open(ShmExport* shm, const char* name) {
+  long page = sysconf(_SC_PAGESIZE);
+  size_t header_size = (sizeof(ShmHeader) + page - 1) / page * page;
+  size_t slot_size = (TEXTURE_BUFSIZE + page - 1) / page * page;
+
+  snprintf(shm->name, sizeof(shm->name), "%s", name);
+  shm->size = header_size + SHM_SLOTS * slot_size;
+
+  int fd = shm_open(shm->name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "[SHM] Cannot create %s\n", shm->name);
+    return false;
+  }
+  void* base = MAP_FAILED;
+  if (ftruncate(fd, shm->size) == 0) {
+    base = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "[SHM] Cannot map %zu bytes for %s\n", shm->size, shm->name);
+    shm_unlink(shm->name);
+    return false;
+  }
+
+  shm->header = base;
+  shm->frames = (unsigned char*)base + header_size;
+  memory_charge(MEMORY_EXPORT, shm->size);
+  *shm->header = (ShmHeader){
+    .version = SHM_VERSION,
+    .width = SCREEN_WIDTH,
+    .height = SCREEN_HEIGHT,
+    .stride = SCREEN_WIDTH * sizeof(Color),
+    .format = 0,
+    .slot_count = SHM_SLOTS,
+    .header_size = header_size,
+    .slot_size = slot_size,
   };
+  // Readers key off the magic, so it goes in last.
+  atomic_thread_fence(memory_order_release);
+  shm->header->magic = SHM_MAGIC;
+  printf("[SHM] Exporting frames to %s (%d slots)\n", shm->name, SHM_SLOTS);
+  return true;
+}
 
-  // TODO: check for failure?
-  mtx_init(&state.swap_lock, mtx_plain);
+void shm_export_frame(ShmExport* shm, const Color* pixels, uint64_t generation) {
+  ShmHeader* header = shm->header;
+  uint64_t frame = atomic_load_explicit(&header->published, memory_order_relaxed);
+  uint32_t index = frame % SHM_SLOTS;
 
-  thrd_t thr;
-  thrd_create(&thr, worker, &state);
+  atomic_store_explicit(&header->slots[index].sequence, 2 * frame + 1, memory_order_relaxed);
+  // Keeps the pixel stores below from becoming visible before the odd sequence does.
+  atomic_thread_fence(memory_order_release);
+  memcpy(shm->frames + index * header->slot_size, pixels, TEXTURE_BUFSIZE);
+  header->slots[index].generation = generation;
+  header->slots[index].timestamp = now_seconds();
+  atomic_store_explicit(&header->slots[index].sequence, 2 * frame + 2, memory_order_release);
 
-  while (!WindowShouldClose()) {
+  atomic_store(&header->published, frame + 1);
+  atomic_fetch_add(&header->futex, 1);
+  syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
 
-    bool view_changed = false;
+void shm_export_close(ShmExport* shm) {
+  munmap(shm->header, shm->size);
+  memory_release(MEMORY_EXPORT, shm->size);
+  shm_unlink(shm->name);
+}
 
-    if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
-      state.width *= ZOOM_FACTOR;
-      state.height *= ZOOM_FACTOR;
-      
-      Vector2 mouse_pos = GetMousePosition();
-      real_t mouse_real = state.real_min + state.scalex * (mouse_pos.x + 0.5L);
-      real_t mouse_imag = state.imag_min + state.scalex * ((real_t)(SCREEN_HEIGHT - mouse_pos.y - 1) + 0.5L);
+void io_ring_close(IoRing* ring) {
+  if (ring->sqes != NULL) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (ring->sq_ring != NULL) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+  if (ring->ring_fd >= 0) {
+    close(ring->ring_fd);
+  }
+  *ring = (IoRing){ .ring_fd = -1 };
+}
+
+// Sets up a ring with room for `entries` requests, or leaves ring_fd at -1.
+bool io_ring_init(IoRing* ring, unsigned entries) {
+  *ring = (IoRing){ .ring_fd = -1 };
+  struct io_uring_params params = { 0 };
+  int fd = syscall(SYS_io_uring_setup, entries, &params);
+  if (fd < 0) {
+    return false;
+  }
+  ring->ring_fd = fd;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && ring->cq_ring_size > ring->sq_ring_size) {
+    ring->sq_ring_size = ring->cq_ring_size;
+  }
+  void* sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                       IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED) {
+    io_ring_close(ring);
+    return false;
+  }
+  ring->sq_ring = sq_ring;
+  void* cq_ring = single ? sq_ring : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  if (cq_ring == MAP_FAILED) {
+    io_ring_close(ring);
+    return false;
+  }
+  ring->cq_ring = cq_ring;
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                    IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    io_ring_close(ring);
+    return false;
+  }
+  ring->sqes = sqes;
+
+  unsigned char* sq = sq_ring;
+  unsigned char* cq = cq_ring;
+  ring->sq_tail = (_Atomic unsigned*)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+  ring->cq_head = (_Atomic unsigned*)(cq + params.cq_off.head);
+  ring->cq_tail = (_Atomic unsigned*)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  return true;
+}
+
+/* Submits a write of `size` bytes at `offset` of fd. Only one thread
+ * submits, and it never has more writes in flight than the ring holds.
+ * If the submission fails, the entry is taken back off the ring, so the
+ * caller can write the data some other way.
+ */
+bool io_ring_write(IoRing* ring, int fd, const void* data, size_t size, uint64_t offset, uint64_t user_data) {
+  unsigned tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)data;
+  sqe->len = size < (1u << 30) ? size : (1u << 30);
+  sqe->off = offset;
+  sqe->user_data = user_data;
+  ring->sq_array[index] = index;
+  atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+  long submitted;
+  do {
+    submitted = syscall(SYS_io_uring_enter, ring->ring_fd, 1, 0, 0, NULL, 0);
+  } while (submitted < 0 && errno == EINTR);
+  if (submitted != 1) {
+    // The kernel consumed nothing, so the entry is still ours to withdraw.
+    atomic_store_explicit(ring->sq_tail, tail, memory_order_release);
+    return false;
+  }
+  return true;
+}
+
+/* Takes the next completion off the ring, waiting for one if `wait`.
+ * Returns false if there is none, or if waiting for one failed.
+ */
+bool io_ring_complete(IoRing* ring, bool wait, uint64_t* user_data, int* result) {
+  unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+  while (head == atomic_load_explicit(ring->cq_tail, memory_order_acquire)) {
+    if (!wait) {
+      return false;
+    }
+    if (syscall(SYS_io_uring_enter, ring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+      return false;
+    }
+  }
+  struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+  *user_data = cqe->user_data;
+  *result = cqe->res;
+  atomic_store_explicit(ring->cq_head, head + 1, memory_order_release);
+  return true;
+}
+
+// Defined with the pool below; the encoder splits its work over the render threads.
+void pool_run(RenderPool* pool, Job* job);
+
+// zlib allocates the deflate state from the worker's scratch, which is reset after the task.
+static voidpf png_alloc(voidpf arena, uInt items, uInt size) {
+  return arena_alloc(arena, (size_t)items * size);
+}
+
+static void png_free(voidpf arena, voidpf address) {
+  (void)arena;
+  (void)address;
+}
+
+/* Deflates one strip as a raw stream. All but the last end on a sync
+ * flush, which byte-aligns them without ending the stream, so the strips
+ * read back as one deflate stream once put end to end. Each strip starts
+ * without history, which costs well under a percent at PNG_STRIP_BYTES.
+ */
+void png_strip(Job* pool_job, int task, Worker* worker) {
+  PngJob* job = pool_job->context;
+  size_t row_size = (size_t)job->width * sizeof(Color);
+  int y0 = task * job->strip_rows;
+  int y1 = y0 + job->strip_rows < job->height ? y0 + job->strip_rows : job->height;
+  bool last = y1 == job->height;
+
+  z_stream stream = { .zalloc = png_alloc, .zfree = png_free, .opaque = &worker->arena };
+  if (deflateInit2(&stream, PNG_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    atomic_store(&job->failed, true);
+    return;
+  }
+  stream.next_out = job->out + job->offsets[task];
+  stream.avail_out = job->bounds[task];
+  uLong checksum = adler32(0, NULL, 0);
+  unsigned char filter = 0;
+  int status = Z_OK;
+  for (int y = y0; y < y1 && status == Z_OK; ++y) {
+    const unsigned char* row = job->pixels + y * row_size;
+    checksum = adler32(checksum, &filter, 1);
+    checksum = adler32(checksum, row, row_size);
+    stream.next_in = &filter;
+    stream.avail_in = 1;
+    status = deflate(&stream, Z_NO_FLUSH);
+    stream.next_in = (unsigned char*)row;
+    stream.avail_in = row_size;
+    int flush = y + 1 < y1 ? Z_NO_FLUSH : (last ? Z_FINISH : Z_SYNC_FLUSH);
+    status = status == Z_OK ? deflate(&stream, flush) : status;
+  }
+  bool done = last ? status == Z_STREAM_END : status == Z_OK && stream.avail_out > 0;
+  job->sizes[task] = stream.total_out;
+  job->checksums[task] = checksum;
+  deflateEnd(&stream);
+  if (!done) {
+    atomic_store(&job->failed, true);
+  }
+}
 
-      state.center_real = mouse_real;
-      state.center_imag = mouse_imag;
+static void png_put32(unsigned char* out, uint32_t value) {
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value;
+}
 
-      state.real_min = state.center_real - state.width * 0.5L;
-      state.imag_min = state.center_imag - state.height * 0.5L;
+// Fills in the length and CRC of a chunk whose type and data are at `chunk` + 4.
+static void png_seal_chunk(unsigned char* chunk, uint32_t size) {
+  png_put32(chunk, size);
+  png_put32(chunk + 8 + size, crc32(0, chunk + 4, 4 + size));
+}
 
-      state.scalex = state.width / (real_t)SCREEN_WIDTH;
-      state.scaley = state.height / (real_t)SCREEN_HEIGHT;
+/* Encodes RGBA pixels as a PNG into buffer->file, growing it as needed.
+ * The strips are deflated in parallel on `pool`, then stitched into a
+ * single zlib stream: one header, the strips in order, and their adler32
+ * checksums combined into the trailer. Rows are stored unfiltered: with
+ * the escape bands of a fractal, the filters buy little over what
+ * deflate finds on its own.
+ */
+bool png_encode(RenderPool* pool, Arena* scratch, OutputBuffer* buffer, int width, int height) {
+  size_t row_size = (size_t)width * sizeof(Color);
+  int strip_rows = PNG_STRIP_BYTES / (1 + row_size);
+  strip_rows = strip_rows > 0 ? strip_rows : 1;
+  int strips = (height + strip_rows - 1) / strip_rows;
 
-      view_changed = true;
+  arena_reset(scratch);
+  PngJob job = {
+    .pixels = (const unsigned char*)buffer->pixels,
+    .width = width,
+    .height = height,
+    .strip_rows = strip_rows,
+    .offsets = arena_alloc(scratch, strips * sizeof(*job.offsets)),
+    .bounds = arena_alloc(scratch, strips * sizeof(*job.bounds)),
+    .sizes = arena_alloc(scratch, strips * sizeof(*job.sizes)),
+    .checksums = arena_alloc(scratch, strips * sizeof(*job.checksums)),
+    .failed = ATOMIC_VAR_INIT(false),
+  };
+  // Signature, IHDR, IDAT around the zlib header and the strips, IEND.
+  size_t data_start = 8 + 25 + 8;
+  size_t size = data_start + 2;
+  for (int strip = 0; strip < strips; ++strip) {
+    int rows = strip + 1 < strips ? strip_rows : height - strip * strip_rows;
+    // A sync flush adds up to 5 bytes past what deflateBound() allows for.
+    job.bounds[strip] = deflateBound(NULL, (1 + row_size) * rows) + 8;
+    job.offsets[strip] = size;
+    size += job.bounds[strip];
+  }
+  size_t capacity = size + 4 + 4 + 12;
+  if (capacity > buffer->file_capacity) {
+    memory_release(MEMORY_EXPORT, buffer->file_capacity);
+    free(buffer->file);
+    buffer->file = malloc(capacity);
+    buffer->file_capacity = buffer->file != NULL ? capacity : 0;
+    memory_charge(MEMORY_EXPORT, buffer->file_capacity);
+    if (buffer->file == NULL) {
+      return false;
     }
+  }
+  job.out = buffer->file;
+
+  Job pool_job = { .run = png_strip, .context = &job, .task_count = strips };
+  pool_run(pool, &pool_job);
+  if (atomic_load(&job.failed)) {
+    return false;
+  }
 
-    if (view_changed && !atomic_load(&state.dirty)) {
-      atomic_store(&state.dirty, true);
+  unsigned char* out = buffer->file;
+  memcpy(out, "\x89PNG\r\n\x1a\n", 8);
+  unsigned char* ihdr = out + 8;
+  memcpy(ihdr + 4, "IHDR", 4);
+  png_put32(ihdr + 8, width);
+  png_put32(ihdr + 12, height);
+  ihdr[16] = 8;  // bits per channel
+  ihdr[17] = 6;  // RGBA
+  ihdr[18] = 0;  // deflate
+  ihdr[19] = 0;  // no filter method beyond the per-row byte
+  ihdr[20] = 0;  // not interlaced
+  png_seal_chunk(ihdr, 13);
+
+  unsigned char* idat = ihdr + 25;
+  memcpy(idat + 4, "IDAT", 4);
+  unsigned char* data = out + data_start;
+  // Deflate with a 32K window at the fastest level; 0x7801 is a multiple of 31.
+  data[0] = 0x78;
+  data[1] = 0x01;
+  unsigned char* end = data + 2;
+  uLong checksum = adler32(0, NULL, 0);
+  for (int strip = 0; strip < strips; ++strip) {
+    int rows = strip + 1 < strips ? strip_rows : height - strip * strip_rows;
+    // Regions only move down, in order, so no strip is overwritten before it moves.
+    memmove(end, out + job.offsets[strip], job.sizes[strip]);
+    end += job.sizes[strip];
+    checksum = adler32_combine(checksum, job.checksums[strip], (z_off_t)((1 + row_size) * rows));
+  }
+  png_put32(end, checksum);
+  end += 4;
+  png_seal_chunk(idat, end - data);
+
+  unsigned char* iend = end + 4;
+  memcpy(iend + 4, "IEND", 4);
+  png_seal_chunk(iend, 0);
+  buffer->file_size = iend + 12 - out;
+  return true;
+}
+
+// Frees the buffers, ring and scratch of a queue that no thread uses any more.
+static void output_free(OutputQueue* queue) {
+  for (int i = 0; i < OUTPUT_BUFFERS; ++i) {
+    OutputBuffer* buffer = &queue->buffers[i];
+    if (buffer->pixels != NULL) {
+      memory_release(MEMORY_EXPORT, (size_t)queue->width * queue->height * sizeof(Color));
     }
+    memory_release(MEMORY_EXPORT, buffer->file_capacity);
+    free(buffer->pixels);
+    free(buffer->file);
+  }
+  arena_free(&queue->scratch);
+  io_ring_close(&queue->ring);
+  mtx_destroy(&queue->lock);
+  cnd_destroy(&queue->changed);
+}
 
-    if (atomic_load(&state.ready)) {
-      mtx_lock(&state.swap_lock);
-      UpdateTexture(texture, state.front);
-      mtx_unlock(&state.swap_lock);
-      atomic_store(&state.ready, false);
+// Sets up the queue. On failure, prints why and leaves nothing to free.
+bool output_open(OutputQueue* queue, RenderPool* pool, int width, int height) {
+  *queue = (OutputQueue){ .width = width, .height = height, .pool = pool, .ring = { .ring_fd = -1 } };
+  arena_init(&queue->scratch, "output", MEMORY_EXPORT, ARENA_CAPACITY);
+  mtx_init(&queue->lock, mtx_plain);
+  cnd_init(&queue->changed);
+  for (int i = 0; i < OUTPUT_BUFFERS; ++i) {
+    OutputBuffer* buffer = &queue->buffers[i];
+    buffer->pixels = malloc((size_t)width * height * sizeof(Color));
+    buffer->fd = -1;
+    if (buffer->pixels == NULL) {
+      fprintf(stderr, "[OUTPUT] Cannot allocate %dx%d frames\n", width, height);
+      output_free(queue);
+      return false;
     }
-    
-    BeginDrawing();
-    ClearBackground(BLACK);
-    DrawTexture(texture, 0, 0, WHITE);
-    EndDrawing();
+    memory_charge(MEMORY_EXPORT, (size_t)width * height * sizeof(Color));
+  }
+  if (!io_ring_init(&queue->ring, 2 * OUTPUT_BUFFERS)) {
+    printf("[OUTPUT] io_uring unavailable, writing from the output thread\n");
+  }
+  return true;
+}
+
+// Returns the next buffer to fill, blocking while the output stage still holds it.
+OutputBuffer* output_reserve(OutputQueue* queue) {
+  mtx_lock(&queue->lock);
+  OutputBuffer* buffer = &queue->buffers[queue->next_fill];
+  while (buffer->state != OUTPUT_FREE) {
+    cnd_wait(&queue->changed, &queue->lock);
+  }
+  mtx_unlock(&queue->lock);
+  return buffer;
+}
+
+void output_push(OutputQueue* queue, OutputBuffer* buffer) {
+  mtx_lock(&queue->lock);
+  buffer->state = OUTPUT_QUEUED;
+  queue->next_fill = (queue->next_fill + 1) % OUTPUT_BUFFERS;
+  cnd_broadcast(&queue->changed);
+  mtx_unlock(&queue->lock);
+}
+
+static void output_release(OutputQueue* queue, OutputBuffer* buffer, bool ok) {
+  if (buffer->fd >= 0) {
+    close(buffer->fd);
+    buffer->fd = -1;
+  }
+  if (!ok) {
+    fprintf(stderr, "[OUTPUT] Cannot write %s\n", buffer->path);
+    queue->failed++;
+  }
+  queue->write_time += now_seconds() - buffer->write_start;
+  queue->bytes += buffer->written;
+  queue->frames++;
+
+  mtx_lock(&queue->lock);
+  buffer->state = OUTPUT_FREE;
+  cnd_broadcast(&queue->changed);
+  mtx_unlock(&queue->lock);
+}
+
+// Handles one write completion, waiting for it if `wait`. Returns false if there was none.
+static bool output_complete(OutputQueue* queue, bool wait) {
+  uint64_t index;
+  int result;
+  if (!io_ring_complete(&queue->ring, wait, &index, &result)) {
+    return false;
+  }
+  OutputBuffer* buffer = &queue->buffers[index];
+  if (result > 0) {
+    buffer->written += result;
+  }
+  if (result > 0 && buffer->written < buffer->file_size &&
+      io_ring_write(&queue->ring, buffer->fd, buffer->file + buffer->written,
+                    buffer->file_size - buffer->written, buffer->written, index)) {
+    // A short write, the rest is back in flight.
+    return true;
+  }
+  queue->in_flight--;
+  output_release(queue, buffer, buffer->written == buffer->file_size);
+  return true;
+}
+
+// Encodes a queued buffer and writes it out, through the ring if there is one.
+static void output_write(OutputQueue* queue, OutputBuffer* buffer) {
+  double start = now_seconds();
+  bool ok = png_encode(queue->pool, &queue->scratch, buffer, queue->width, queue->height);
+  queue->encode_time += now_seconds() - start;
+  queue->encoded_bytes += (size_t)queue->width * queue->height * sizeof(Color);
+
+  buffer->written = 0;
+  buffer->write_start = now_seconds();
+  buffer->fd = ok ? open(buffer->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+  if (buffer->fd < 0) {
+    output_release(queue, buffer, false);
+    return;
   }
 
-  state.quit = true;
-  thrd_join(thr, NULL);
+  if (queue->ring.ring_fd >= 0 &&
+      io_ring_write(&queue->ring, buffer->fd, buffer->file, buffer->file_size, 0, buffer - queue->buffers)) {
+    mtx_lock(&queue->lock);
+    buffer->state = OUTPUT_WRITING;
+    mtx_unlock(&queue->lock);
+    queue->in_flight++;
+    return;
+  }
+  while (buffer->written < buffer->file_size) {
+    ssize_t result = write(buffer->fd, buffer->file + buffer->written, buffer->file_size - buffer->written);
+    if (result <= 0) {
+      break;
+    }
+    buffer->written += result;
+  }
+  output_release(queue, buffer, buffer->written == buffer->file_size);
+}
+
+/* Gives up on a ring that can no longer be waited on: closing it lets
+ * the kernel finish or cancel what is in flight, and those frames count
+ * as failed. Later frames are written from the output thread.
+ */
+static void output_abandon_ring(OutputQueue* queue) {
+  fprintf(stderr, "[OUTPUT] io_uring failed: %s\n", strerror(errno));
+  io_ring_close(&queue->ring);
+  for (int i = 0; i < OUTPUT_BUFFERS; ++i) {
+    if (queue->buffers[i].state == OUTPUT_WRITING) {
+      output_release(queue, &queue->buffers[i], false);
+    }
+  }
+  queue->in_flight = 0;
+}
+
+/* The output stage of a headless render: encodes the queued frames in
+ * order and writes them out. With io_uring, encoding the next frame
+ * overlaps the writes of the previous ones.
+ */
+int output_stage(void* arg) {
+  OutputQueue* queue = arg;
+  while (true) {
+    while (queue->in_flight > 0 && output_complete(queue, false)) {
+    }
+
+    mtx_lock(&queue->lock);
+    OutputBuffer* buffer = &queue->buffers[queue->next_encode];
+    bool queued = buffer->state == OUTPUT_QUEUED;
+    if (queued) {
+      queue->next_encode = (queue->next_encode + 1) % OUTPUT_BUFFERS;
+    } else if (queue->in_flight == 0 && queue->closing) {
+      mtx_unlock(&queue->lock);
+      break;
+    } else if (queue->in_flight == 0) {
+      cnd_wait(&queue->changed, &queue->lock);
+    }
+    mtx_unlock(&queue->lock);
+
+    if (queued) {
+      output_write(queue, buffer);
+    } else if (queue->in_flight > 0 && !output_complete(queue, true)) {
+      output_abandon_ring(queue);
+    }
+  }
+  return 0;
+}
+
+/* Waits for the output stage to write everything queued and frees the
+ * queue. Returns false if any frame could not be written.
+ */
+bool output_close(OutputQueue* queue, thrd_t thread) {
+  mtx_lock(&queue->lock);
+  queue->closing = true;
+  cnd_broadcast(&queue->changed);
+  mtx_unlock(&queue->lock);
+  thrd_join(thread, NULL);
+
+  printf("[OUTPUT] %d frames, %.1f MB: encode %.1f ms (%.0f MB/s on %d threads), write %.1f ms (%s)\n",
+         queue->frames, queue->bytes / 1048576.0, queue->encode_time * 1000.0,
+         queue->encoded_bytes / 1048576.0 / (queue->encode_time > 0.0 ? queue->encode_time : 1.0),
+         queue->pool->thread_count, queue->write_time * 1000.0, queue->ring.ring_fd >= 0 ? "io_uring" : "blocking");
+  bool written = queue->failed == 0;
+  output_free(queue);
+  return written;
+}
+
+// Rounds an mpf to long double, which has more bits than mpf_get_d() returns.
+real_t mpf_get_real(const mpf_t value) {
+  mpf_t rest;
+  mpf_init2(rest, mpf_get_prec(value));
+  double high = mpf_get_d(value);
+  mpf_set_d(rest, high);
+  mpf_sub(rest, value, rest);
+  double low = mpf_get_d(rest);
+  mpf_clear(rest);
+  return (real_t)high + low;
+}
+
+void mpf_add_real(mpf_t value, real_t offset) {
+  // Split off the exponent first, deep offsets are out of the range of double.
+  int exponent;
+  real_t mantissa = frexpl(offset, &exponent);
+  double high = mantissa;
+  double low = mantissa - high;
+  mpf_t term;
+  mpf_init2(term, 64);
+  for (int part = 0; part < 2; ++part) {
+    mpf_set_d(term, part == 0 ? high : low);
+    if (exponent >= 0) {
+      mpf_mul_2exp(term, term, exponent);
+    } else {
+      mpf_div_2exp(term, term, -exponent);
+    }
+    mpf_add(value, value, term);
+  }
+  mpf_clear(term);
+}
+
+// Enough bits to address every pixel of a view of this width.
+mp_bitcnt_t view_precision_bits(real_t width) {
+  real_t depth = -log2l(width);
+  return 64 + (depth > 0.0L ? (mp_bitcnt_t)depth : 0);
+}
+
+// Recomputes everything derived from the exact center and the width.
+void view_update(View* view) {
+  mp_bitcnt_t bits = view_precision_bits(view->width);
+  if (mpf_get_prec(view->exact_real) < bits) {
+    mpf_set_prec(view->exact_real, bits);
+    mpf_set_prec(view->exact_imag, bits);
+  }
+  view->height = view->width * ((real_t)view->image_height / view->image_width);
+  view->center_real = mpf_get_real(view->exact_real);
+  view->center_imag = mpf_get_real(view->exact_imag);
+  view->real_min = view->center_real - view->width * 0.5L;
+  view->imag_min = view->center_imag - view->height * 0.5L;
+  view->scalex = view->width / (real_t)view->image_width;
+  view->scaley = view->height / (real_t)view->image_height;
+}
+
+/* Mandelbrot lives in [-2, 2]/[-2, 2] square, so we need
+ * to map screen coordinates to is. However, for a prettier
+ * more centered image it is recommended to use:
+ * - [-2.0, 1.0] for the real part
+ * - [-1.5, 1.5] for the imaginary
+ */
+void view_init(View* view, int image_width, int image_height) {
+  view->image_width = image_width;
+  view->image_height = image_height;
+  view->width = 3.0L;
+  mpf_init2(view->exact_real, 64);
+  mpf_init2(view->exact_imag, 64);
+  mpf_set_d(view->exact_real, -0.5);
+  mpf_set_d(view->exact_imag, 0.0);
+  view_update(view);
+}
+
+// Centers the view on a decimal coordinate, at full precision.
+bool view_set_center(View* view, const char* real, const char* imag, real_t width) {
+  view->width = width;
+  mp_bitcnt_t bits = view_precision_bits(width);
+  mpf_set_prec(view->exact_real, bits);
+  mpf_set_prec(view->exact_imag, bits);
+  if (mpf_set_str(view->exact_real, real, 10) != 0 || mpf_set_str(view->exact_imag, imag, 10) != 0) {
+    return false;
+  }
+  view_update(view);
+  return true;
+}
+
+// Moves the center by an offset from where it is and scales the width.
+void view_zoom(View* view, real_t offset_real, real_t offset_imag, real_t factor) {
+  view->width *= factor;
+  view_update(view);
+  mpf_add_real(view->exact_real, offset_real);
+  mpf_add_real(view->exact_imag, offset_imag);
+  view_update(view);
+}
+
+void view_copy(View* dst, const View* src) {
+  mpf_set_prec(dst->exact_real, mpf_get_prec(src->exact_real));
+  mpf_set_prec(dst->exact_imag, mpf_get_prec(src->exact_imag));
+  mpf_set(dst->exact_real, src->exact_real);
+  mpf_set(dst->exact_imag, src->exact_imag);
+  dst->image_width = src->image_width;
+  dst->image_height = src->image_height;
+  dst->width = src->width;
+  view_update(dst);
+}
+
+void view_clear(View* view) {
+  mpf_clear(view->exact_real);
+  mpf_clear(view->exact_imag);
+}
+
+/* Where a frame rendered for `from` shows up in `to`: `source` is the
+ * part of the frame that `to` covers, in pixels of the frame, and
+ * `dest` where that part goes on screen for `to`. Returns false when
+ * the two do not overlap.
+ */
+bool view_reprojection(const View* from, const View* to, Rectangle* source, Rectangle* dest) {
+  // The offset between the centers, in pixels of `from`, exactly at any depth.
+  mpf_t offset;
+  mpf_init2(offset, mpf_get_prec(to->exact_real));
+  mpf_sub(offset, to->exact_real, from->exact_real);
+  real_t dx = mpf_get_real(offset) / from->scalex;
+  mpf_sub(offset, to->exact_imag, from->exact_imag);
+  real_t dy = -mpf_get_real(offset) / from->scaley;
+  mpf_clear(offset);
+
+  real_t scale = to->scalex / from->scalex;
+  real_t left = from->image_width * 0.5L + dx - to->image_width * scale * 0.5L;
+  real_t top = from->image_height * 0.5L + dy - to->image_height * scale * 0.5L;
+  real_t x0 = fmaxl(left, 0.0L);
+  real_t y0 = fmaxl(top, 0.0L);
+  real_t x1 = fminl(left + to->image_width * scale, from->image_width);
+  real_t y1 = fminl(top + to->image_height * scale, from->image_height);
+  if (x0 >= x1 || y0 >= y1) {
+    return false;
+  }
+  *source = (Rectangle){ (float)x0, (float)y0, (float)(x1 - x0), (float)(y1 - y0) };
+  *dest = (Rectangle){ (float)((x0 - left) / scale), (float)((y0 - top) / scale), (float)((x1 - x0) / scale),
+                       (float)((y1 - y0) / scale) };
+  return true;
+}
+
+int view_max_iterations(const View* view) {
+  return 64 + 4 * log10l(1.0L / view->width);
+}
+
+int pool_thread(void* arg) {
+  Worker* worker = arg;
+  RenderPool* pool = worker->pool;
+
+  mtx_lock(&pool->lock);
+  while (true) {
+    while (pool->jobs == NULL && !pool->quit) {
+      atomic_fetch_add(&pool->idle, 1);
+      cnd_wait(&pool->work, &pool->lock);
+      atomic_fetch_sub(&pool->idle, 1);
+    }
+    if (pool->jobs == NULL) {
+      break;
+    }
+
+    Job* job = pool->jobs;
+    int task = job->next_task++;
+    if (job->next_task == job->task_count) {
+      // Everything is handed out, the remaining tasks are in flight.
+      pool->jobs = job->next;
+    }
+    worker->busy = true;
+    worker->task_start = now_seconds();
+    mtx_unlock(&pool->lock);
+
+    arena_reset(&worker->arena);
+    job->run(job, task, worker);
+
+    mtx_lock(&pool->lock);
+    worker->busy = false;
+    job->busy_time += now_seconds() - worker->task_start;
+    if (++job->tasks_done == job->task_count) {
+      cnd_broadcast(&pool->done);
+    }
+  }
+  mtx_unlock(&pool->lock);
+  return 0;
+}
+
+// MemoryShrink for the scratch arenas of idle workers.
+size_t pool_shrink(void* context, size_t wanted) {
+  RenderPool* pool = context;
+  size_t freed = 0;
+  mtx_lock(&pool->lock);
+  for (int i = 0; i < pool->thread_count && freed < wanted; ++i) {
+    Worker* worker = &pool->workers[i];
+    if (!worker->busy) {
+      arena_reset(&worker->arena);
+      freed += arena_trim(&worker->arena);
+    }
+  }
+  mtx_unlock(&pool->lock);
+  return freed;
+}
+
+void pool_init(RenderPool* pool, int thread_count) {
+  pool->thread_count = thread_count;
+  pool->workers = calloc(thread_count, sizeof(*pool->workers));
+  pool->jobs = NULL;
+  pool->quit = false;
+  atomic_init(&pool->idle, 0);
+  mtx_init(&pool->lock, mtx_plain);
+  cnd_init(&pool->work);
+  cnd_init(&pool->done);
+
+  for (int i = 0; i < thread_count; ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "worker%d", i);
+    Worker* worker = &pool->workers[i];
+    worker->id = i;
+    worker->pool = pool;
+    arena_init(&worker->arena, name, MEMORY_TILES, TILE_ARENA_CAPACITY);
+    thrd_create(&worker->thread, pool_thread, worker);
+  }
+  memory_register(pool_shrink, pool);
+}
+
+/* Queues the job and blocks until all of its tasks have run. An urgent
+ * job goes ahead of the queued ones, for short jobs that hold up a
+ * frame that is already rendered.
+ */
+void pool_submit(RenderPool* pool, Job* job, bool urgent) {
+  if (job->task_count == 0) {
+    return;
+  }
+  job->next_task = 0;
+  job->tasks_done = 0;
+  job->next = NULL;
+
+  mtx_lock(&pool->lock);
+  if (urgent) {
+    job->next = pool->jobs;
+    pool->jobs = job;
+  } else {
+    Job** tail = &pool->jobs;
+    while (*tail != NULL) {
+      tail = &(*tail)->next;
+    }
+    *tail = job;
+  }
+  cnd_broadcast(&pool->work);
+
+  while (job->tasks_done < job->task_count) {
+    cnd_wait(&pool->done, &pool->lock);
+  }
+  mtx_unlock(&pool->lock);
+}
+
+/* Appends `count` tasks to a job that has not finished yet, which only
+ * a task of the job itself can be sure of. They go ahead of the queued
+ * jobs: they are the tail of one that is already running.
+ */
+void pool_add_tasks(RenderPool* pool, Job* job, int count) {
+  mtx_lock(&pool->lock);
+  if (job->next_task == job->task_count) {
+    // Everything was handed out, so the job left the queue.
+    job->next = pool->jobs;
+    pool->jobs = job;
+  }
+  job->task_count += count;
+  cnd_broadcast(&pool->work);
+  mtx_unlock(&pool->lock);
+}
+
+/* Sums the workers' counters. Only render jobs count pixels, and only
+ * one runs at a time, so the difference across render_job_run() is that
+ * job's.
+ */
+void pool_counters(RenderPool* pool, long long* iterated, long long* rebased) {
+  *iterated = 0;
+  *rebased = 0;
+  mtx_lock(&pool->lock);
+  for (int i = 0; i < pool->thread_count; ++i) {
+    *iterated += pool->workers[i].iterated;
+    *rebased += pool->workers[i].rebased;
+  }
+  mtx_unlock(&pool->lock);
+}
+
+void pool_run(RenderPool* pool, Job* job) {
+  pool_submit(pool, job, false);
+}
+
+void pool_run_urgent(RenderPool* pool, Job* job) {
+  pool_submit(pool, job, true);
+}
+
+void pool_destroy(RenderPool* pool, bool report) {
+  memory_unregister(pool);
+  mtx_lock(&pool->lock);
+  pool->quit = true;
+  cnd_broadcast(&pool->work);
+  mtx_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->thread_count; ++i) {
+    thrd_join(pool->workers[i].thread, NULL);
+    if (report) {
+      arena_report(&pool->workers[i].arena);
+    }
+    arena_free(&pool->workers[i].arena);
+  }
+  free(pool->workers);
+  mtx_destroy(&pool->lock);
+  cnd_destroy(&pool->work);
+  cnd_destroy(&pool->done);
+}
+
+/* Sets up storage for an orbit of up to max_iterations steps. It comes
+ * out of the arena while it fits there and stays within `budget` and
+ * what is left of the memory budget; bigger orbits go to an unlinked
+ * temporary file that is mapped in, so the kernel can page them in and
+ * out instead of them pinning memory.
+ */
+void orbit_alloc(ReferenceOrbit* ref, OrbitFormat format, int max_iterations, Arena* arena, size_t budget) {
+  size_t entry = format == ORBIT_FLOAT ? sizeof(float) : sizeof(double);
+  size_t array = ((max_iterations + 1) * entry + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+  unsigned char* base = MAP_FAILED;
+
+  *ref = (ReferenceOrbit){ .format = format, .target = ATOMIC_VAR_INIT(max_iterations) };
+  if (2 * array <= budget && 2 * array <= arena_available(arena) && 2 * array <= memory_headroom()) {
+    base = arena_alloc(arena, 2 * array);
+  } else {
+    const char* dir = getenv("TMPDIR");
+    char path[512];
+    snprintf(path, sizeof(path), "%s/mzoom-orbit-XXXXXX", dir != NULL ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+      unlink(path);
+      if (ftruncate(fd, 2 * array) == 0) {
+        base = mmap(NULL, 2 * array, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      }
+      close(fd);
+    }
+    if (fd < 0 || base == MAP_FAILED) {
+      fprintf(stderr, "[ORBIT] Cannot map %zu bytes for a reference orbit in %s\n", 2 * array, path);
+      abort();
+    }
+    ref->mapping = base;
+    ref->mapping_size = 2 * array;
+    memory_charge(MEMORY_ORBITS, ref->mapping_size);
+  }
+
+  if (format == ORBIT_FLOAT) {
+    ref->zr_compact = (float*)base;
+    ref->zi_compact = (float*)(base + array);
+  } else {
+    ref->zr = (double*)base;
+    ref->zi = (double*)(base + array);
+  }
+}
+
+void orbit_release(ReferenceOrbit* ref) {
+  if (ref->mapping != NULL) {
+    munmap(ref->mapping, ref->mapping_size);
+    memory_release(MEMORY_ORBITS, ref->mapping_size);
+    ref->mapping = NULL;
+  }
+}
+
+// Makes Z_0 .. Z_length visible to the kernels and wakes those waiting for them.
+void orbit_publish(ReferenceOrbit* ref, int length, bool complete) {
+  atomic_store_explicit(&ref->length, length, memory_order_release);
+  if (complete) {
+    atomic_store(&ref->complete, true);
+  }
+  atomic_fetch_add(&ref->progress, 1);
+  if (atomic_load(&ref->waiters) > 0) {
+    syscall(SYS_futex, &ref->progress, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+  }
+}
+
+/* The limit for a point at iteration n: it may iterate up to Z_limit,
+ * and no further than max_iterations. If the orbit is still being
+ * computed and has nothing past Z_n yet, blocks until it does.
+ */
+static inline int orbit_limit(const ReferenceOrbit* ref, int n, int max_iterations) {
+  int length = atomic_load_explicit(&ref->length, memory_order_acquire);
+  while (length <= n && length < max_iterations && !atomic_load(&ref->complete)) {
+    ReferenceOrbit* shared = (ReferenceOrbit*)ref;
+    int progress = atomic_load(&shared->progress);
+    atomic_fetch_add(&shared->waiters, 1);
+    if (atomic_load_explicit(&ref->length, memory_order_acquire) <= n && !atomic_load(&ref->complete)) {
+      syscall(SYS_futex, &shared->progress, FUTEX_WAIT_PRIVATE, progress, NULL, NULL, 0);
+    }
+    atomic_fetch_sub(&shared->waiters, 1);
+    length = atomic_load_explicit(&ref->length, memory_order_acquire);
+  }
+  return max_iterations < length ? max_iterations : length;
+}
+
+static inline void orbit_get(const ReferenceOrbit* ref, int n, double* zr, double* zi) {
+  if (ref->format == ORBIT_FLOAT) {
+    *zr = ref->zr_compact[n];
+    *zi = ref->zi_compact[n];
+  } else {
+    *zr = ref->zr[n];
+    *zi = ref->zi[n];
+  }
+}
+
+/* Computes the orbit of c = cr + ci*i at the precision of cr, for
+ * perturbation. Only the rounded values are kept: the delta kernels
+ * never need more than double out of it. Entries are published as they
+ * come, but the orbit is only marked complete by the caller. Returns
+ * false if an entry does not fit the orbit's format.
+ */
+bool reference_compute(ReferenceOrbit* ref, const mpf_t cr, const mpf_t ci, int max_iterations) {
+  mp_bitcnt_t bits = mpf_get_prec(cr);
+  mpf_t zr, zi, zr2, zi2;
+  mpf_init2(zr, bits);
+  mpf_init2(zi, bits);
+  mpf_init2(zr2, bits);
+  mpf_init2(zi2, bits);
+
+  bool fits = true;
+  for (int n = 0; n <= max_iterations; ++n) {
+    double r = mpf_get_d(zr);
+    double i = mpf_get_d(zi);
+    if (ref->format == ORBIT_FLOAT) {
+      // Below FLT_MIN a float starts dropping relative precision.
+      if ((r != 0.0 && fabs(r) < FLT_MIN) || (i != 0.0 && fabs(i) < FLT_MIN)) {
+        fits = false;
+        break;
+      }
+      ref->zr_compact[n] = (float)r;
+      ref->zi_compact[n] = (float)i;
+    } else {
+      ref->zr[n] = r;
+      ref->zi[n] = i;
+    }
+    if (r * r + i * i > 4.0 || n >= atomic_load_explicit(&ref->target, memory_order_relaxed)) {
+      orbit_publish(ref, n, false);
+      break;
+    }
+    if (n % ORBIT_CHUNK == ORBIT_CHUNK - 1) {
+      orbit_publish(ref, n, false);
+    }
+
+    mpf_mul(zr2, zr, zr);
+    mpf_mul(zi2, zi, zi);
+    mpf_mul(zi, zi, zr);
+    mpf_mul_2exp(zi, zi, 1);
+    mpf_add(zi, zi, ci);
+    mpf_sub(zr, zr2, zi2);
+    mpf_add(zr, zr, cr);
+  }
+
+  mpf_clear(zr);
+  mpf_clear(zi);
+  mpf_clear(zr2);
+  mpf_clear(zi2);
+  return fits;
+}
+
+// Allocates and computes a reference orbit, in double if it does not fit `format`.
+void reference_build(ReferenceOrbit* ref, OrbitFormat format, const mpf_t cr, const mpf_t ci,
+                     int max_iterations, Arena* arena, size_t budget) {
+  orbit_alloc(ref, format, max_iterations, arena, budget);
+  if (!reference_compute(ref, cr, ci, max_iterations)) {
+    orbit_release(ref);
+    orbit_alloc(ref, ORBIT_DOUBLE, max_iterations, arena, budget);
+    reference_compute(ref, cr, ci, max_iterations);
+  }
+  orbit_publish(ref, atomic_load(&ref->length), true);
+}
+
+int reference_stream_run(void* arg) {
+  ReferenceStream* stream = arg;
+  double start = now_seconds();
+  reference_compute(stream->orbit, stream->cr, stream->ci, stream->max_iterations);
+  orbit_publish(stream->orbit, atomic_load(&stream->orbit->length), true);
+  stream->time = now_seconds() - start;
+  return 0;
+}
+
+/* Like reference_build(), but the orbit is computed on a thread of its
+ * own while the kernels already use what there is of it, so the pixels
+ * of a deep frame start without waiting for the whole orbit. cr and ci
+ * must stay put until reference_stream_end() or reference_stream_finish().
+ * Compact orbits are built up front: the kernels cannot switch to double
+ * halfway through one that turns out not to fit.
+ */
+void reference_stream(ReferenceStream* stream, ReferenceOrbit* ref, OrbitFormat format, const mpf_t cr,
+                      const mpf_t ci, int max_iterations, Arena* arena, size_t budget) {
+  *stream = (ReferenceStream){ .orbit = ref, .cr = cr, .ci = ci, .max_iterations = max_iterations };
+  if (format == ORBIT_FLOAT) {
+    double start = now_seconds();
+    reference_build(ref, format, cr, ci, max_iterations, arena, budget);
+    stream->time = now_seconds() - start;
+    return;
+  }
+  orbit_alloc(ref, format, max_iterations, arena, budget);
+  stream->threaded = thrd_create(&stream->thread, reference_stream_run, stream) == thrd_success;
+  if (!stream->threaded) {
+    reference_stream_run(stream);
+  }
+}
+
+// Stops the computation short of where nobody will read, for once the frame's limit is known.
+void reference_stream_limit(ReferenceStream* stream, int max_iterations) {
+  atomic_store(&stream->orbit->target, max_iterations);
+}
+
+// Waits for the orbit thread to get to the limit, for an orbit that is read on after the frame.
+void reference_stream_finish(ReferenceStream* stream) {
+  if (stream->threaded) {
+    thrd_join(stream->thread, NULL);
+    stream->threaded = false;
+  }
+}
+
+// Stops the orbit thread where it is and waits for it, once nothing reads the orbit any more.
+void reference_stream_end(ReferenceStream* stream) {
+  if (stream->threaded) {
+    atomic_store(&stream->orbit->target, 0);
+    thrd_join(stream->thread, NULL);
+    stream->threaded = false;
+  }
+}
+
+/* How a delta iteration that stopped at iteration n (already counted)
+ * with z = (zr, zi), |z|**2 = magnitude and dz/dc = (dr, di) ends up.
+ * Shared by all perturbation kernels so that they agree bit for bit.
+ */
+static inline void perturb_finish(int point, int64_t n, double magnitude, bool glitch, int max_iterations,
+                                  double zr, double zi, double dr, double di, const PerturbResults* results) {
+  bool interior = false;
+  if (magnitude > 4.0) {
+    results->nu[point] = (float)((double)n - log2(log2(magnitude)));
+    results->glitched[point] = 0;
+  } else if (glitch) {
+    results->nu[point] = (float)n;
+    results->glitched[point] = 1;
+  } else if (n >= max_iterations) {
+    results->nu[point] = -1.0f;
+    results->glitched[point] = 0;
+    interior = true;
+  } else {
+    // The reference escaped before this point did.
+    results->nu[point] = (float)n;
+    results->glitched[point] = 1;
+  }
+  if (results->iterations != NULL) {
+    results->iterations[point] = interior ? -1 : (int)n;
+  }
+  if (results->dr != NULL) {
+    results->zr[point] = zr;
+    results->zi[point] = zi;
+    results->dr[point] = dr;
+    results->di[point] = di;
+  }
+}
+
+/* Delta iteration, with Z the reference orbit and z = Z + dz:
+ *   dz(n+1) = 2*Z(n)*dz(n) + dz(n)**2 + dc
+ * A point is glitched once |z| gets small next to |Z| (Pauldelbrot's
+ * criterion), as dz then no longer carries enough precision.
+ */
+void perturb_scalar(const ReferenceOrbit* ref, const double* dcr, const double* dci,
+                    const PerturbStart* start, int count, int max_iterations, const PerturbResults* results) {
+  bool derivative = results->dr != NULL;
+  int limit = orbit_limit(ref, 0, max_iterations);
+  for (int p = 0; p < count; ++p) {
+    if (start != NULL && start->n[p] < 0) {
+      continue;
+    }
+    double dzr = start != NULL ? start->dzr[p] : 0.0;
+    double dzi = start != NULL ? start->dzi[p] : 0.0;
+    double dr = start != NULL && derivative ? start->dr[p] : 0.0;
+    double di = start != NULL && derivative ? start->di[p] : 0.0;
+    double magnitude = 0.0;
+    bool glitch = false;
+    int n = start != NULL ? start->n[p] : 0;
+    double r = 0.0, i = 0.0;
+    while (n < limit || (limit = orbit_limit(ref, n, max_iterations)) > n) {
+      double zr, zi;
+      orbit_get(ref, n, &zr, &zi);
+      if (derivative) {
+        // dz/dc(n+1) = 2*z(n)*dz/dc(n) + 1, with z = Z + dz.
+        double dr_new = 2.0 * ((zr + dzr) * dr - (zi + dzi) * di) + 1.0;
+        di = 2.0 * ((zr + dzr) * di + (zi + dzi) * dr);
+        dr = dr_new;
+      }
+      double dzr_new = 2.0 * (zr * dzr - zi * dzi) + dzr * dzr - dzi * dzi + dcr[p];
+      dzi = 2.0 * (zr * dzi + zi * dzr + dzr * dzi) + dci[p];
+      dzr = dzr_new;
+      n++;
+
+      double ref_r, ref_i;
+      orbit_get(ref, n, &ref_r, &ref_i);
+      r = ref_r + dzr;
+      i = ref_i + dzi;
+      magnitude = r * r + i * i;
+      if (magnitude > 4.0) {
+        break;
+      }
+      if (magnitude < GLITCH_TOLERANCE * (ref_r * ref_r + ref_i * ref_i)) {
+        glitch = true;
+        break;
+      }
+    }
+    perturb_finish(p, n, magnitude, glitch, max_iterations, r, i, dr, di, results);
+  }
+}
+
+/* Rescaled iterations: the delta is kept as dz = w * 2^k, with w a
+ * plain double and k an exponent per point, so
+ *   w(n+1) = 2*Z(n)*w(n) + 2^k * w(n)**2 + dc * 2^-k
+ * runs at double speed. w grows with the delta, and is only brought back
+ * next to 1 (moving its exponent into k) once it drifts past
+ * RESCALE_LIMIT. While k is below DEEP_EXPONENT, 2^k * w**2 is that far
+ * below the rounding error of w and dz that far below |Z|, so both are
+ * left out; z escapes when Z does and is never glitched. Once dz is past
+ * 2^DEEP_EXPONENT the point goes back to the kernel's loop. For the same
+ * reason dz/dc follows Z alone; it is a plain double, which only
+ * overflows where the distance is too small for a float anyway.
+ */
+void perturb_rescaled(const ReferenceOrbit* ref, const double* dcr, const double* dci, int exponent,
+                      int count, int max_iterations, const PerturbResults* results, PerturbStart* start) {
+  bool derivative = results->dr != NULL;
+  int limit = orbit_limit(ref, 0, max_iterations);
+  for (int p = 0; p < count; ++p) {
+    double wr = 0.0;
+    double wi = 0.0;
+    int k = exponent;
+    double cr = dcr[p];
+    double ci = dci[p];
+    double dr = 0.0;
+    double di = 0.0;
+    double zr = 0.0, zi = 0.0;
+    double magnitude = 0.0;
+    int n = 0;
+    while ((n < limit || (limit = orbit_limit(ref, n, max_iterations)) > n) && k < DEEP_EXPONENT) {
+      orbit_get(ref, n, &zr, &zi);
+      if (derivative) {
+        double dr_new = 2.0 * (zr * dr - zi * di) + 1.0;
+        di = 2.0 * (zr * di + zi * dr);
+        dr = dr_new;
+      }
+      double wr_new = 2.0 * (zr * wr - zi * wi) + cr;
+      wi = 2.0 * (zr * wi + zi * wr) + ci;
+      wr = wr_new;
+      n++;
+
+      if (wr * wr + wi * wi > RESCALE_LIMIT) {
+        int shift = ilogb(fmax(fabs(wr), fabs(wi)));
+        wr = ldexp(wr, -shift);
+        wi = ldexp(wi, -shift);
+        k += shift;
+        // Past DEEP_EXPONENT below w, dc no longer changes it; zero keeps clear of subnormals.
+        cr = exponent - k > DEEP_EXPONENT ? ldexp(dcr[p], exponent - k) : 0.0;
+        ci = exponent - k > DEEP_EXPONENT ? ldexp(dci[p], exponent - k) : 0.0;
+      }
+
+      orbit_get(ref, n, &zr, &zi);
+      magnitude = zr * zr + zi * zi;
+      if (magnitude > 4.0) {
+        break;
+      }
+    }
+
+    if (magnitude > 4.0 || n >= limit) {
+      perturb_finish(p, n, magnitude, false, max_iterations, zr, zi, dr, di, results);
+      start->n[p] = -1;
+    } else {
+      start->n[p] = n;
+      start->dzr[p] = ldexp(wr, k);
+      start->dzi[p] = ldexp(wi, k);
+      if (derivative) {
+        start->dr[p] = dr;
+        start->di[p] = di;
+      }
+    }
+  }
+}
+
+/* A double mantissa in [1, 2) and a wide exponent: value = mantissa * 2^exponent.
+ * Zero has a zero mantissa.
+ */
+typedef struct {
+  double mantissa;
+  int64_t exponent;
+} FloatExp;
+
+static inline FloatExp floatexp_make(double mantissa, int64_t exponent) {
+  uint64_t bits;
+  memcpy(&bits, &mantissa, sizeof(bits));
+  int64_t biased = (bits >> 52) & 0x7ff;
+  if (biased == 0) {
+    // Mantissas are products and sums of normal numbers, this is zero.
+    return (FloatExp){ 0.0, 0 };
+  }
+  bits = (bits & ~(0x7ffull << 52)) | (1023ull << 52);
+  memcpy(&mantissa, &bits, sizeof(bits));
+  return (FloatExp){ mantissa, exponent + biased - 1023 };
+}
+
+static inline FloatExp floatexp_mul(FloatExp a, FloatExp b) {
+  return floatexp_make(a.mantissa * b.mantissa, a.exponent + b.exponent);
+}
+
+static inline FloatExp floatexp_add(FloatExp a, FloatExp b) {
+  if (a.mantissa == 0.0 || (b.mantissa != 0.0 && b.exponent > a.exponent)) {
+    FloatExp t = a;
+    a = b;
+    b = t;
+  }
+  int64_t shift = a.exponent - b.exponent;
+  if (b.mantissa == 0.0 || shift > 60) {
+    return a;
+  }
+  return floatexp_make(a.mantissa + ldexp(b.mantissa, (int)-shift), a.exponent);
+}
+
+static inline double floatexp_to_double(FloatExp a) {
+  return a.exponent < -1100 ? 0.0 : ldexp(a.mantissa, (int)a.exponent);
+}
+
+/* A disk of complex numbers, for circular interval arithmetic: it
+ * holds every value within `radius` of the center. Squaring a disk
+ * gives a disk without the slack a rectangle picks up when it turns,
+ * so a disk of orbits around an attracting cycle shrinks where a
+ * rectangle would keep growing. Every step adds a bound on its own
+ * rounding errors to the radius, so the disk holds the exact values
+ * whichever way the FPU rounded. Double is enough: a tile that needs
+ * long double still spans many ulps of double, and the bounds only need
+ * to hold, not to be tight.
+ */
+typedef struct {
+  double real;
+  double imag;
+  double radius;
+} Disk;
+
+// Rounds a computed bound up past its own rounding error.
+static inline double bound_up(double value) {
+  return value * (1.0 + 4.0 * DBL_EPSILON) + DBL_MIN;
+}
+
+// z**2 + c for every z and c of the disks.
+static inline Disk disk_step(Disk z, Disk c) {
+  double size = z.real * z.real + z.imag * z.imag;
+  Disk next = {
+    z.real * z.real - z.imag * z.imag + c.real,
+    2.0 * z.real * z.imag + c.imag,
+    0.0,
+  };
+  // |(z0 + d)**2 - z0**2| <= 2 |z0| r + r**2, plus what rounding the center cost.
+  double rounding = 4.0 * DBL_EPSILON * (size + fabs(c.real) + fabs(c.imag));
+  next.radius = bound_up(2.0 * bound_up(sqrt(size)) * z.radius + z.radius * z.radius + c.radius + rounding);
+  return next;
+}
+
+// Bounds on |z| over the disk. Centers stay well inside the range where
+// the square root of the sum of squares needs no hypot().
+static inline double disk_max(Disk z) {
+  return bound_up(bound_up(sqrt(z.real * z.real + z.imag * z.imag)) + z.radius);
+}
+
+static inline double disk_min(Disk z) {
+  return sqrt(z.real * z.real + z.imag * z.imag) * (1.0 - 4.0 * DBL_EPSILON) - z.radius;
+}
+
+/* Whether every orbit of the disk `c` that is in `z` stays bounded for
+ * good. The disk is grown to twice its size into a trap; if the trap
+ * maps into itself after some p <= CERTIFY_PERIOD steps without leaving
+ * |z| <= 2 on the way, an orbit that enters it comes back every p steps
+ * and never escapes. Attracting cycles of period p contract a small disk
+ * around them, so the interior of the bulbs of low period is caught.
+ */
+bool disk_trapped(Disk z, Disk c) {
+  Disk trap = { z.real, z.imag, 2.0 * z.radius };
+  if (disk_max(trap) > 2.0) {
+    return false;
+  }
+  Disk image = trap;
+  for (int p = 1; p <= CERTIFY_PERIOD; ++p) {
+    image = disk_step(image, c);
+    if (disk_max(image) > 2.0) {
+      return false;
+    }
+    double offset_real = image.real - trap.real;
+    double offset_imag = image.imag - trap.imag;
+    double offset = sqrt(offset_real * offset_real + offset_imag * offset_imag);
+    if (bound_up(bound_up(offset) + image.radius) <= trap.radius) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Iterates all of the disk `c` at once, as a disk of z that holds every
+ * orbit. Returns n > 0 when every point provably escapes on step n, 0
+ * when none escapes within max_iterations, and -1 once the disk
+ * straddles the bailout circle and nothing can be said. The trap of
+ * disk_trapped() is tried every time n doubles, so interior disks end
+ * early instead of running to the limit.
+ */
+int certify_disk(Disk c, int max_iterations) {
+  Disk z = { 0.0, 0.0, 0.0 };
+  double last_radius = INFINITY;
+  for (int n = 1; n <= max_iterations; ++n) {
+    z = disk_step(z, c);
+    if (disk_min(z) > 2.0) {
+      return n;
+    }
+    if (disk_max(z) > 2.0) {
+      return -1;
+    }
+    if (n >= 8 && (n & (n - 1)) == 0) {
+      if (z.radius <= 2.0 * last_radius && disk_trapped(z, c)) {
+        return 0;
+      }
+      last_radius = z.radius;
+    }
+  }
+  return 0;
+}
+
+/* The delta iteration of perturb_scalar() with every delta a FloatExp,
+ * all the way, the straightforward way past the range of double and the
+ * baseline perturb_rescaled() is measured against.
+ */
+void perturb_floatexp(const ReferenceOrbit* ref, const double* dcr, const double* dci, int exponent,
+                      int count, int max_iterations, const PerturbResults* results, PerturbStart* start) {
+  bool derivative = results->dr != NULL;
+  int limit = orbit_limit(ref, 0, max_iterations);
+  for (int p = 0; p < count; ++p) {
+    start->n[p] = -1;
+    FloatExp cr = floatexp_make(dcr[p], exponent);
+    FloatExp ci = floatexp_make(dci[p], exponent);
+    FloatExp dzr = { 0.0, 0 };
+    FloatExp dzi = { 0.0, 0 };
+    // dz/dc needs no wide exponent, see perturb_rescaled().
+    double dr = 0.0;
+    double di = 0.0;
+    double magnitude = 0.0;
+    bool glitch = false;
+    int n = 0;
+    double r = 0.0, i = 0.0;
+    while (n < limit || (limit = orbit_limit(ref, n, max_iterations)) > n) {
+      double zr, zi;
+      orbit_get(ref, n, &zr, &zi);
+      if (derivative) {
+        double fr = zr + floatexp_to_double(dzr);
+        double fi = zi + floatexp_to_double(dzi);
+        double dr_new = 2.0 * (fr * dr - fi * di) + 1.0;
+        di = 2.0 * (fr * di + fi * dr);
+        dr = dr_new;
+      }
+      FloatExp zr2 = floatexp_make(2.0 * zr, 0);
+      FloatExp zi2 = floatexp_make(2.0 * zi, 0);
+      FloatExp minus_dzi = { -dzi.mantissa, dzi.exponent };
+      FloatExp dzr_new = floatexp_add(floatexp_add(floatexp_mul(zr2, dzr), floatexp_mul(zi2, minus_dzi)),
+                                      floatexp_add(floatexp_add(floatexp_mul(dzr, dzr),
+                                                                floatexp_mul(dzi, minus_dzi)), cr));
+      FloatExp dzr2 = { 2.0 * dzr.mantissa, dzr.exponent };
+      dzi = floatexp_add(floatexp_add(floatexp_mul(zr2, dzi), floatexp_mul(zi2, dzr)),
+                         floatexp_add(floatexp_mul(dzr2, dzi), ci));
+      dzr = dzr_new;
+      n++;
+
+      double ref_r, ref_i;
+      orbit_get(ref, n, &ref_r, &ref_i);
+      r = ref_r + floatexp_to_double(dzr);
+      i = ref_i + floatexp_to_double(dzi);
+      magnitude = r * r + i * i;
+      if (magnitude > 4.0) {
+        break;
+      }
+      if (magnitude < GLITCH_TOLERANCE * (ref_r * ref_r + ref_i * ref_i)) {
+        glitch = true;
+        break;
+      }
+    }
+    perturb_finish(p, n, magnitude, glitch, max_iterations, r, i, dr, di, results);
+  }
+}
+
+static const PerturbDeepFn deep_perturb[DEEP_DELTAS_COUNT] = { perturb_rescaled, perturb_floatexp };
+
+#define DEFINE_KERNEL_SCALAR(name, type, iterate)                             \
+  void name(const RenderJob* job, int x0, int y0, int x1, int y1) {           \
+    const View* view = &job->view;                                            \
+    type scalex = view->scalex;                                               \
+    type scaley = view->scaley;                                               \
+    type real_min = view->real_min;                                           \
+    type imag_min = view->imag_min;                                           \
+                                                                              \
+    for (int y = y0; y < y1; ++y) {                                           \
+      type imag = scaley * ((type)(view->image_height-y-1) + 0.5f) + imag_min; \
+                                                                              \
+      for (int x = x0; x < x1; ++x) {                                         \
+        type real = scalex * ((type)x + 0.5f) + real_min;                     \
+        job->nu[y * view->image_width + x] = iterate(real, imag, job->max_iterations); \
+      }                                                                       \
+    }                                                                         \
+  }
+
+DEFINE_KERNEL_SCALAR(kernel_scalar_float, float, mandelbrot_float)
+DEFINE_KERNEL_SCALAR(kernel_scalar_double, double, mandelbrot_double)
+DEFINE_KERNEL_SCALAR(kernel_scalar_long_double, real_t, mandelbrot)
+
+/* Writes out a point of a PointSet that stopped after n iterations, with
+ * z and its derivative dz/dc where it stopped. The distance estimate
+ *   |z| * ln|z| / |dz/dc|
+ * is only close once |z| is large, well past the bailout of 2, so an
+ * escaped point is iterated on in double until |z|**2 > DISTANCE_BAILOUT;
+ * with |z| squared every step, that takes a handful of iterations.
+ */
+static inline void point_finish(const PointResults* results, int point, bool escaped, int n, float nu,
+                                double zr, double zi, double dr, double di, double cr, double ci) {
+  if (results->iterations != NULL) {
+    results->iterations[point] = escaped ? n : -1;
+  }
+  if (results->nu != NULL) {
+    results->nu[point] = escaped ? nu : -1.0f;
+  }
+  if (results->distance == NULL) {
+    return;
+  }
+  if (!escaped) {
+    results->distance[point] = 0.0f;
+    return;
+  }
+  double magnitude = zr * zr + zi * zi;
+  for (int i = 0; i < 16 && magnitude < DISTANCE_BAILOUT; ++i) {
+    double dr_new = 2.0 * (zr * dr - zi * di) + 1.0;
+    di = 2.0 * (zr * di + zi * dr);
+    dr = dr_new;
+    double zr_new = zr * zr - zi * zi + cr;
+    zi = 2.0 * zr * zi + ci;
+    zr = zr_new;
+    magnitude = zr * zr + zi * zi;
+  }
+  // A derivative that overflowed leaves a distance too small for a float.
+  float distance = (float)(0.5 * sqrt(magnitude) * log(magnitude) / hypot(dr, di));
+  results->distance[point] = isfinite(distance) ? distance : 0.0f;
+}
+
+/* DEFINE_MANDELBROT over the points of a PointSet. The derivative is only
+ * carried when a distance is asked for.
+ */
+#define DEFINE_POINTS_SCALAR(name, type, log2fn)                              \
+  void name(const PointSet* points, int first, int count, int max_iterations, \
+            const PointResults* results) {                                    \
+    bool derivative = results->distance != NULL;                              \
+    for (int p = first; p < first + count; ++p) {                             \
+      type cr = points->real[p];                                              \
+      type ci = points->imag[p];                                              \
+      type zr = 0, zi = 0, dr = 0, di = 0, magnitude = 0;                     \
+      int n = 0;                                                              \
+      while (n < max_iterations) {                                            \
+        if (derivative) {                                                     \
+          type dr_new = 2 * (zr * dr - zi * di) + 1;                          \
+          di = 2 * (zr * di + zi * dr);                                       \
+          dr = dr_new;                                                        \
+        }                                                                     \
+        type zr_new = zr * zr - zi * zi + cr;                                 \
+        zi = 2 * zr * zi + ci;                                                \
+        zr = zr_new;                                                          \
+        n++;                                                                  \
+        magnitude = zr * zr + zi * zi;                                        \
+        if (magnitude > 4) {                                                  \
+          break;                                                              \
+        }                                                                     \
+      }                                                                       \
+      bool escaped = magnitude > 4;                                           \
+      float nu = escaped ? (type)(n - 1) + 1 - log2fn(log2fn(magnitude)) : -1; \
+      point_finish(results, p, escaped, n, nu, zr, zi, dr, di, cr, ci);       \
+    }                                                                         \
+  }
+
+DEFINE_POINTS_SCALAR(points_scalar_float, float, log2f)
+DEFINE_POINTS_SCALAR(points_scalar_double, double, log2)
+DEFINE_POINTS_SCALAR(points_scalar_long_double, real_t, log2l)
+
+/* The vector kernels below are written once with GCC vector extensions
+ * and instantiated per target, with `bytes` the width of its vector
+ * registers. Vector extensions cannot express a gather or a test of a
+ * whole mask, so those come in as parameters; the portable versions here
+ * work on any target, and a target with a better instruction for them
+ * plugs it in. They expect the kernel's `vec` and LANES.
+ */
+#define LANES_GATHER(base, index) ({                                          \
+    vec gathered;                                                             \
+    _Pragma("GCC unroll 8")                                                   \
+    for (int lane = 0; lane < LANES; ++lane) {                                \
+      gathered[lane] = (base)[(index)[lane]];                                 \
+    }                                                                         \
+    gathered;                                                                 \
+  })
+
+#define LANES_GATHER_FLOAT(base, index) ({                                    \
+    typedef float fvec __attribute__((vector_size(sizeof(vec) / 2)));         \
+    fvec gathered;                                                            \
+    _Pragma("GCC unroll 8")                                                   \
+    for (int lane = 0; lane < LANES; ++lane) {                                \
+      gathered[lane] = (base)[(index)[lane]];                                 \
+    }                                                                         \
+    __builtin_convertvector(gathered, vec);                                   \
+  })
+
+// Reads the mask as 64-bit words, which unrolls into a few extracts.
+#define LANES_ANY(mask) ({                                                    \
+    typedef uint64_t words_t __attribute__((vector_size(sizeof(mask))));      \
+    words_t words = (words_t)(mask);                                          \
+    uint64_t any = 0;                                                         \
+    _Pragma("GCC unroll 8")                                                   \
+    for (int w = 0; w < (int)(sizeof(mask) / sizeof(uint64_t)); ++w) {        \
+      any |= words[w];                                                        \
+    }                                                                         \
+    any != 0;                                                                 \
+  })
+
+/* Every lane works on its own point at its own iteration; a lane whose
+ * point is done is refilled with the next one right away, so no lane
+ * idles until the slowest point of a batch finishes. Parked lanes have
+ * point -1. The lane_ vectors keep the lanes between batches, the inner
+ * loop runs on register copies of them. The arithmetic is the scalar
+ * kernel's term for term, so all kernels agree bit for bit.
+ */
+#define DEFINE_KERNEL_VECTOR(name, type, itype, bytes, log2fn, attributes, lanes_any) \
+  attributes void name(const RenderJob* job, int x0, int y0, int x1, int y1) { \
+    typedef type vec __attribute__((vector_size(bytes)));                     \
+    typedef itype ivec __attribute__((vector_size(bytes)));                   \
+    enum { LANES = bytes / sizeof(type) };                                    \
+    const View* view = &job->view;                                            \
+    type scalex = view->scalex;                                               \
+    type scaley = view->scaley;                                               \
+    type real_min = view->real_min;                                           \
+    type imag_min = view->imag_min;                                           \
+    int tile_width = x1 - x0;                                                 \
+    int count = tile_width * (y1 - y0);                                       \
+                                                                              \
+    vec lane_cr = { 0 }, lane_ci = { 0 }, lane_zr = { 0 }, lane_zi = { 0 };   \
+    ivec lane_n = { 0 }, lane_live = { 0 };                                   \
+    int point[LANES];                                                         \
+    int next = 0;                                                             \
+    int active = 0;                                                           \
+    for (int lane = 0; lane < LANES; ++lane) {                                \
+      point[lane] = -1;                                                       \
+    }                                                                         \
+                                                                              \
+    for (;;) {                                                                \
+      for (int lane = 0; lane < LANES; ++lane) {                              \
+        if (point[lane] < 0 && next < count) {                                \
+          int x = x0 + next % tile_width;                                     \
+          int y = y0 + next / tile_width;                                     \
+          lane_cr[lane] = scalex * ((type)x + 0.5f) + real_min;               \
+          lane_ci[lane] = scaley * ((type)(view->image_height-y-1) + 0.5f) + imag_min; \
+          lane_zr[lane] = 0;                                                  \
+          lane_zi[lane] = 0;                                                  \
+          lane_n[lane] = 0;                                                   \
+          lane_live[lane] = -1;                                               \
+          point[lane] = next++;                                               \
+          active++;                                                           \
+        }                                                                     \
+      }                                                                       \
+      if (active == 0) {                                                      \
+        break;                                                                \
+      }                                                                       \
+                                                                              \
+      vec cr = lane_cr, ci = lane_ci, zr = lane_zr, zi = lane_zi, magnitude;  \
+      ivec n = lane_n, escaped, finished;                                     \
+      do {                                                                    \
+        vec zr_new = zr * zr - zi * zi + cr;                                  \
+        zi = (type)2 * zr * zi + ci;                                          \
+        zr = zr_new;                                                          \
+        n += 1;                                                               \
+        magnitude = zr * zr + zi * zi;                                        \
+        escaped = magnitude > (type)4;                                        \
+        finished = (escaped | (n >= job->max_iterations)) & lane_live;        \
+      } while (!lanes_any(finished));                                         \
+      lane_zr = zr;                                                           \
+      lane_zi = zi;                                                           \
+      lane_n = n;                                                             \
+                                                                              \
+      for (int lane = 0; lane < LANES; ++lane) {                              \
+        if (finished[lane]) {                                                 \
+          int x = x0 + point[lane] % tile_width;                              \
+          int y = y0 + point[lane] / tile_width;                              \
+          job->nu[y * view->image_width + x] = escaped[lane]                  \
+            ? (type)(n[lane] - 1) + 1 - log2fn(log2fn(magnitude[lane]))       \
+            : -1;                                                             \
+          /* A parked lane never escapes: c = 0 is in the set. */             \
+          lane_cr[lane] = 0;                                                  \
+          lane_ci[lane] = 0;                                                  \
+          lane_zr[lane] = 0;                                                  \
+          lane_zi[lane] = 0;                                                  \
+          lane_live[lane] = 0;                                                \
+          point[lane] = -1;                                                   \
+          active--;                                                           \
+        }                                                                     \
+      }                                                                       \
+    }                                                                         \
+  }
+
+/* perturb_scalar() on the lanes of a vector register, refilled as in
+ * DEFINE_KERNEL_VECTOR. Each lane carries Z(n) over from its previous
+ * iteration, so it loads one orbit entry per iteration; while lanes run
+ * in step the loads hit the same cache lines, so the reference is
+ * effectively loaded once for all of them. The body is instantiated per
+ * orbit format, and with and without the derivative, so the inner loop
+ * tests neither.
+ */
+#define DEFINE_PERTURB_VECTOR(name, bytes, attributes, gather, gather_float, lanes_any) \
+  attributes __attribute__((always_inline))                                   \
+  static inline void name##_format(const ReferenceOrbit* ref, const double* dcr, const double* dci, \
+                                   const PerturbStart* start, int count,      \
+                                   int max_iterations, const PerturbResults* results, \
+                                   bool compact, bool derivative) {           \
+    typedef double vec __attribute__((vector_size(bytes)));                   \
+    typedef int64_t ivec __attribute__((vector_size(bytes)));                 \
+    enum { LANES = bytes / sizeof(double) };                                  \
+    int limit = orbit_limit(ref, 0, max_iterations);                          \
+                                                                              \
+    vec lane_dcr = { 0 }, lane_dci = { 0 }, lane_dzr = { 0 }, lane_dzi = { 0 }; \
+    vec lane_zr = { 0 }, lane_zi = { 0 };  /* Z(0) = 0 */                     \
+    vec lane_dr = { 0 }, lane_di = { 0 };                                     \
+    ivec lane_n = { 0 }, lane_live = { 0 };                                   \
+    int point[LANES];                                                         \
+    int next = 0;                                                             \
+    int active = 0;                                                           \
+    for (int lane = 0; lane < LANES; ++lane) {                                \
+      point[lane] = -1;                                                       \
+    }                                                                         \
+                                                                              \
+    for (;;) {                                                                \
+      for (int lane = 0; lane < LANES; ++lane) {                              \
+        while (start != NULL && next < count && start->n[next] < 0) {        \
+          next++;                                                             \
+        }                                                                     \
+        if (point[lane] < 0 && next < count) {                                \
+          lane_dcr[lane] = dcr[next];                                         \
+          lane_dci[lane] = dci[next];                                         \
+          if (start != NULL) {                                                \
+            double zr0, zi0;                                                  \
+            orbit_get(ref, start->n[next], &zr0, &zi0);                       \
+            lane_zr[lane] = zr0;                                              \
+            lane_zi[lane] = zi0;                                              \
+            lane_dzr[lane] = start->dzr[next];                                \
+            lane_dzi[lane] = start->dzi[next];                                \
+            lane_n[lane] = start->n[next];                                    \
+            if (derivative) {                                                 \
+              lane_dr[lane] = start->dr[next];                                \
+              lane_di[lane] = start->di[next];                                \
+            }                                                                 \
+          }                                                                   \
+          lane_live[lane] = -1;                                               \
+          point[lane] = next++;                                               \
+          active++;                                                           \
+        }                                                                     \
+      }                                                                       \
+      if (active == 0) {                                                      \
+        break;                                                                \
+      }                                                                       \
+                                                                              \
+      vec dcr_v = lane_dcr, dci_v = lane_dci, zr = lane_zr, zi = lane_zi;     \
+      vec dzr = lane_dzr, dzi = lane_dzi, magnitude;                          \
+      vec dr = lane_dr, di = lane_di;                                         \
+      ivec n = lane_n, glitch, finished;                                      \
+      do {                                                                    \
+        if (derivative) {                                                     \
+          vec dr_new = 2.0 * ((zr + dzr) * dr - (zi + dzi) * di) + 1.0;       \
+          di = 2.0 * ((zr + dzr) * di + (zi + dzi) * dr);                     \
+          dr = dr_new;                                                        \
+        }                                                                     \
+        vec dzr_new = 2.0 * (zr * dzr - zi * dzi) + dzr * dzr - dzi * dzi + dcr_v; \
+        dzi = 2.0 * (zr * dzi + zi * dzr + dzr * dzi) + dci_v;                \
+        dzr = dzr_new;                                                        \
+        n += 1;                                                               \
+        if (compact) {                                                        \
+          zr = gather_float(ref->zr_compact, n);                              \
+          zi = gather_float(ref->zi_compact, n);                              \
+        } else {                                                              \
+          zr = gather(ref->zr, n);                                            \
+          zi = gather(ref->zi, n);                                            \
+        }                                                                     \
+                                                                              \
+        vec r = zr + dzr;                                                     \
+        vec i = zi + dzi;                                                     \
+        magnitude = r * r + i * i;                                            \
+        glitch = magnitude < GLITCH_TOLERANCE * (zr * zr + zi * zi);          \
+        finished = ((magnitude > 4.0) | glitch | (n >= limit)) & lane_live;   \
+      } while (!lanes_any(finished));                                         \
+      if (limit < max_iterations && lanes_any(finished & (n >= limit))) {     \
+        /* Caught up with an orbit that may still be computed. */             \
+        limit = orbit_limit(ref, limit, max_iterations);                      \
+        finished &= (magnitude > 4.0) | glitch | (n >= limit);                \
+      }                                                                       \
+      lane_zr = zr;                                                           \
+      lane_zi = zi;                                                           \
+      lane_dzr = dzr;                                                         \
+      lane_dzi = dzi;                                                         \
+      lane_dr = dr;                                                           \
+      lane_di = di;                                                           \
+      lane_n = n;                                                             \
+                                                                              \
+      for (int lane = 0; lane < LANES; ++lane) {                              \
+        if (finished[lane]) {                                                 \
+          perturb_finish(point[lane], n[lane], magnitude[lane], glitch[lane], \
+                         max_iterations, zr[lane] + dzr[lane], zi[lane] + dzi[lane], \
+                         dr[lane], di[lane], results);                        \
+          /* Parked lanes restart at 0, which keeps them behind the live      \
+           * ones and their loads inside the orbit.                           \
+           */                                                                 \
+          lane_dcr[lane] = 0.0;                                               \
+          lane_dci[lane] = 0.0;                                               \
+          lane_zr[lane] = 0.0;                                                \
+          lane_zi[lane] = 0.0;                                                \
+          lane_dzr[lane] = 0.0;                                               \
+          lane_dzi[lane] = 0.0;                                               \
+          lane_dr[lane] = 0.0;                                                \
+          lane_di[lane] = 0.0;                                                \
+          lane_n[lane] = 0;                                                   \
+          lane_live[lane] = 0;                                                \
+          point[lane] = -1;                                                   \
+          active--;                                                           \
+        }                                                                     \
+      }                                                                       \
+    }                                                                         \
+  }                                                                           \
+                                                                              \
+  attributes void name(const ReferenceOrbit* ref, const double* dcr, const double* dci, \
+                       const PerturbStart* start, int count, int max_iterations, \
+                       const PerturbResults* results) {                       \
+    bool compact = ref->format == ORBIT_FLOAT;                                \
+    if (compact && results->dr != NULL) {                                     \
+      name##_format(ref, dcr, dci, start, count, max_iterations, results, true, true); \
+    } else if (compact) {                                                     \
+      name##_format(ref, dcr, dci, start, count, max_iterations, results, true, false); \
+    } else if (results->dr != NULL) {                                         \
+      name##_format(ref, dcr, dci, start, count, max_iterations, results, false, true); \
+    } else {                                                                  \
+      name##_format(ref, dcr, dci, start, count, max_iterations, results, false, false); \
+    }                                                                         \
+  }
+
+/* DEFINE_KERNEL_VECTOR over the points of a PointSet. The body is
+ * instantiated with and without the derivative, so the loop only carries
+ * it when a distance is asked for.
+ */
+#define DEFINE_POINTS_VECTOR(name, type, itype, bytes, log2fn, attributes, lanes_any) \
+  attributes __attribute__((always_inline))                                   \
+  static inline void name##_derivative(const PointSet* points, int first, int count, \
+                                       int max_iterations, const PointResults* results, \
+                                       bool derivative) {                     \
+    typedef type vec __attribute__((vector_size(bytes)));                     \
+    typedef itype ivec __attribute__((vector_size(bytes)));                   \
+    enum { LANES = bytes / sizeof(type) };                                    \
+    int end = first + count;                                                  \
+                                                                              \
+    vec lane_cr = { 0 }, lane_ci = { 0 }, lane_zr = { 0 }, lane_zi = { 0 };   \
+    vec lane_dr = { 0 }, lane_di = { 0 };                                     \
+    ivec lane_n = { 0 }, lane_live = { 0 };                                   \
+    int point[LANES];                                                         \
+    int next = first;                                                         \
+    int active = 0;                                                           \
+    for (int lane = 0; lane < LANES; ++lane) {                                \
+      point[lane] = -1;                                                       \
+    }                                                                         \
+                                                                              \
+    for (;;) {                                                                \
+      for (int lane = 0; lane < LANES; ++lane) {                              \
+        if (point[lane] < 0 && next < end) {                                  \
+          lane_cr[lane] = (type)points->real[next];                           \
+          lane_ci[lane] = (type)points->imag[next];                           \
+          lane_live[lane] = -1;                                               \
+          point[lane] = next++;                                               \
+          active++;                                                           \
+        }                                                                     \
+      }                                                                       \
+      if (active == 0) {                                                      \
+        break;                                                                \
+      }                                                                       \
+                                                                              \
+      vec cr = lane_cr, ci = lane_ci, zr = lane_zr, zi = lane_zi, magnitude;  \
+      vec dr = lane_dr, di = lane_di;                                         \
+      ivec n = lane_n, escaped, finished;                                     \
+      do {                                                                    \
+        if (derivative) {                                                     \
+          vec dr_new = (type)2 * (zr * dr - zi * di) + (type)1;               \
+          di = (type)2 * (zr * di + zi * dr);                                 \
+          dr = dr_new;                                                        \
+        }                                                                     \
+        vec zr_new = zr * zr - zi * zi + cr;                                  \
+        zi = (type)2 * zr * zi + ci;                                          \
+        zr = zr_new;                                                          \
+        n += 1;                                                               \
+        magnitude = zr * zr + zi * zi;                                        \
+        escaped = magnitude > (type)4;                                        \
+        finished = (escaped | (n >= max_iterations)) & lane_live;             \
+      } while (!lanes_any(finished));                                         \
+      lane_zr = zr;                                                           \
+      lane_zi = zi;                                                           \
+      lane_dr = dr;                                                           \
+      lane_di = di;                                                           \
+      lane_n = n;                                                             \
+                                                                              \
+      for (int lane = 0; lane < LANES; ++lane) {                              \
+        if (finished[lane]) {                                                 \
+          float nu = escaped[lane]                                            \
+            ? (type)(n[lane] - 1) + 1 - log2fn(log2fn(magnitude[lane]))       \
+            : -1;                                                             \
+          point_finish(results, point[lane], escaped[lane], n[lane], nu, zr[lane], zi[lane], \
+                       dr[lane], di[lane], cr[lane], ci[lane]);               \
+          /* A parked lane never escapes: c = 0 is in the set. */             \
+          lane_cr[lane] = 0;                                                  \
+          lane_ci[lane] = 0;                                                  \
+          lane_zr[lane] = 0;                                                  \
+          lane_zi[lane] = 0;                                                  \
+          lane_dr[lane] = 0;                                                  \
+          lane_di[lane] = 0;                                                  \
+          lane_n[lane] = 0;                                                   \
+          lane_live[lane] = 0;                                                \
+          point[lane] = -1;                                                   \
+          active--;                                                           \
+        }                                                                     \
+      }                                                                       \
+    }                                                                         \
+  }                                                                           \
+                                                                              \
+  attributes void name(const PointSet* points, int first, int count, int max_iterations, \
+                       const PointResults* results) {                         \
+    if (results->distance != NULL) {                                          \
+      name##_derivative(points, first, count, max_iterations, results, true); \
+    } else {                                                                  \
+      name##_derivative(points, first, count, max_iterations, results, false); \
+    }                                                                         \
+  }
+
+#define DEFINE_KERNELS_VECTOR(prefix, bytes, attributes, gather, gather_float, lanes_any) \
+  DEFINE_KERNEL_VECTOR(kernel_##prefix##_float, float, int32_t, bytes, log2f, attributes, lanes_any) \
+  DEFINE_KERNEL_VECTOR(kernel_##prefix##_double, double, int64_t, bytes, log2, attributes, lanes_any) \
+  DEFINE_PERTURB_VECTOR(perturb_##prefix, bytes, attributes, gather, gather_float, lanes_any) \
+  DEFINE_POINTS_VECTOR(points_##prefix##_float, float, int32_t, bytes, log2f, attributes, lanes_any) \
+  DEFINE_POINTS_VECTOR(points_##prefix##_double, double, int64_t, bytes, log2, attributes, lanes_any)
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+bool cpu_has_avx2(void) {
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+bool cpu_has_avx512(void) {
+  return __builtin_cpu_supports("avx512f");
+}
+
+#define AVX2_GATHER(base, index) ((vec)_mm256_i64gather_pd((base), (__m256i)(index), 8))
+#define AVX2_GATHER_FLOAT(base, index) ((vec)_mm256_cvtps_pd(_mm256_i64gather_ps((base), (__m256i)(index), 4)))
+#define AVX2_ANY(mask) (!_mm256_testz_si256((__m256i)(mask), (__m256i)(mask)))
+#define AVX512_GATHER(base, index) ((vec)_mm512_i64gather_pd((__m512i)(index), (base), 8))
+#define AVX512_GATHER_FLOAT(base, index) ((vec)_mm512_cvtps_pd(_mm512_i64gather_ps((__m512i)(index), (base), 4)))
+#define AVX512_ANY(mask) (_mm512_test_epi64_mask((__m512i)(mask), (__m512i)(mask)) != 0)
+
+DEFINE_KERNELS_VECTOR(sse2, 16, , LANES_GATHER, LANES_GATHER_FLOAT, LANES_ANY)
+DEFINE_KERNELS_VECTOR(avx2, 32, __attribute__((target("avx2,fma"))),
+                      AVX2_GATHER, AVX2_GATHER_FLOAT, AVX2_ANY)
+DEFINE_KERNELS_VECTOR(avx512, 64, __attribute__((target("avx512f"))),
+                      AVX512_GATHER, AVX512_GATHER_FLOAT, AVX512_ANY)
+#elif defined(__aarch64__)
+/* NEON is part of the base ISA and has no gather. SVE registers have no
+ * size known at compile time, which vector_size cannot express; a build
+ * with -msve-vector-bits=N could add an instance for that N.
+ */
+DEFINE_KERNELS_VECTOR(neon, 16, , LANES_GATHER, LANES_GATHER_FLOAT, LANES_ANY)
+#endif
+
+static const Kernel kernels[] = {
+  { "scalar", NULL, { kernel_scalar_float, kernel_scalar_double, kernel_scalar_long_double }, perturb_scalar,
+    { points_scalar_float, points_scalar_double, points_scalar_long_double } },
+#if defined(__x86_64__)
+  { "sse2", NULL, { kernel_sse2_float, kernel_sse2_double, kernel_scalar_long_double }, perturb_sse2,
+    { points_sse2_float, points_sse2_double, points_scalar_long_double } },
+  { "avx2", cpu_has_avx2, { kernel_avx2_float, kernel_avx2_double, kernel_scalar_long_double }, perturb_avx2,
+    { points_avx2_float, points_avx2_double, points_scalar_long_double } },
+  { "avx512", cpu_has_avx512, { kernel_avx512_float, kernel_avx512_double, kernel_scalar_long_double }, perturb_avx512,
+    { points_avx512_float, points_avx512_double, points_scalar_long_double } },
+#elif defined(__aarch64__)
+  { "neon", NULL, { kernel_neon_float, kernel_neon_double, kernel_scalar_long_double }, perturb_neon,
+    { points_neon_float, points_neon_double, points_scalar_long_double } },
+#endif
+};
+#define KERNEL_COUNT ((int)(sizeof(kernels) / sizeof(kernels[0])))
+
+// max(|c|, 2) over a tile, which the rounding errors of its orbits scale with.
+real_t tile_magnitude(const View* view, int x0, int y0, int x1, int y1) {
+  real_t re0 = view->real_min + view->scalex * x0;
+  real_t re1 = view->real_min + view->scalex * x1;
+  real_t im0 = view->imag_min + view->scaley * (view->image_height - y1);
+  real_t im1 = view->imag_min + view->scaley * (view->image_height - y0);
+  real_t far = fmaxl(fmaxl(fabsl(re0), fabsl(re1)), fmaxl(fabsl(im0), fabsl(im1)));
+  return fmaxl(far, 2.0L);
+}
+
+/* Picks the cheapest backend that can still tell a tile's pixels apart.
+ * Orbits stay within |z| <= 2 until they escape, so a type resolves
+ * about eps * max(|c|, 2) around any point of the tile; the pixel
+ * spacing has to stay `margin` above that to leave room for the
+ * rounding errors the iteration amplifies. A tile entirely outside the
+ * radius-2 circle escapes on the first iteration and gets by with float
+ * regardless of its spacing.
+ */
+Precision tile_precision_margin(const View* view, int x0, int y0, int x1, int y1, real_t margin) {
+  real_t re0 = view->real_min + view->scalex * x0;
+  real_t re1 = view->real_min + view->scalex * x1;
+  real_t im0 = view->imag_min + view->scaley * (view->image_height - y1);
+  real_t im1 = view->imag_min + view->scaley * (view->image_height - y0);
+
+  // Closest point of the tile to the origin.
+  real_t near_re = re0 > 0.0L ? re0 : (re1 < 0.0L ? re1 : 0.0L);
+  real_t near_im = im0 > 0.0L ? im0 : (im1 < 0.0L ? im1 : 0.0L);
+  if (near_re * near_re + near_im * near_im > 4.0L) {
+    return PRECISION_FLOAT;
+  }
+
+  real_t spacing = fminl(view->scalex, view->scaley);
+  real_t magnitude = tile_magnitude(view, x0, y0, x1, y1);
+  if (spacing > magnitude * FLT_EPSILON * margin) {
+    return PRECISION_FLOAT;
+  }
+  if (spacing > magnitude * DBL_EPSILON * margin) {
+    return PRECISION_DOUBLE;
+  }
+  if (spacing > magnitude * LDBL_EPSILON * margin) {
+    return PRECISION_LONG_DOUBLE;
+  }
+  return PRECISION_PERTURBATION;
+}
+
+// The backend a tile is rendered with, PRECISION_MARGIN above its rounding error.
+Precision tile_precision(const View* view, int x0, int y0, int x1, int y1) {
+  return tile_precision_margin(view, x0, y0, x1, y1, PRECISION_MARGIN);
+}
+
+/* With --mixed-precision, tiles are first rendered with the cheapest
+ * backend that still resolves their pixels, MIXED_MARGIN above its
+ * rounding error, and refine_run() recomputes the pixels that came out
+ * sensitive to that with tile_precision()'s. Perturbation tiles are
+ * left as they are: their deltas already iterate in double, and a long
+ * double pass would cost more than it saves.
+ */
+Precision tile_fast_precision(const View* view, int x0, int y0, int x1, int y1) {
+  Precision precision = tile_precision(view, x0, y0, x1, y1);
+  if (precision == PRECISION_PERTURBATION) {
+    return precision;
+  }
+  return tile_precision_margin(view, x0, y0, x1, y1, MIXED_MARGIN);
+}
+
+/* Iterates `count` points against `ref` with `kernel`. Offsets scaled by
+ * 2^-exponent are first brought into the range of double by `deep_deltas`.
+ */
+void perturb_points(const Kernel* kernel, DeepDeltas deep_deltas, int max_iterations, Worker* worker,
+                    const ReferenceOrbit* ref, const double* dcr, const double* dci, int exponent, int count,
+                    const PerturbResults* results) {
+  if (exponent == 0) {
+    kernel->perturb(ref, dcr, dci, NULL, count, max_iterations, results);
+    return;
+  }
+
+  size_t mark = arena_mark(&worker->arena);
+  bool derivative = results->dr != NULL;
+  PerturbStart start = {
+    .n = arena_alloc(&worker->arena, count * sizeof(*start.n)),
+    .dzr = arena_alloc(&worker->arena, count * sizeof(*start.dzr)),
+    .dzi = arena_alloc(&worker->arena, count * sizeof(*start.dzi)),
+    .dr = derivative ? arena_alloc(&worker->arena, count * sizeof(*start.dr)) : NULL,
+    .di = derivative ? arena_alloc(&worker->arena, count * sizeof(*start.di)) : NULL,
+  };
+  deep_perturb[deep_deltas](ref, dcr, dci, exponent, count, max_iterations, results, &start);
+
+  // Where dz fits a double, dc is at most a rounding error next to it.
+  double* cr = arena_alloc(&worker->arena, count * sizeof(*cr));
+  double* ci = arena_alloc(&worker->arena, count * sizeof(*ci));
+  for (int p = 0; p < count; ++p) {
+    cr[p] = ldexp(dcr[p], exponent);
+    ci[p] = ldexp(dci[p], exponent);
+  }
+  kernel->perturb(ref, cr, ci, &start, count, max_iterations, results);
+  arena_rewind(&worker->arena, mark);
+}
+
+// Copies what was found for point i to point j of `out`, which has the same outputs or fewer.
+static inline void perturb_copy(const PerturbResults* out, int j, const PerturbResults* found, int i) {
+  out->nu[j] = found->nu[i];
+  if (out->iterations != NULL) {
+    out->iterations[j] = found->iterations[i];
+  }
+  if (out->dr != NULL) {
+    out->zr[j] = found->zr[i];
+    out->zi[j] = found->zi[i];
+    out->dr[j] = found->dr[i];
+    out->di[j] = found->di[i];
+  }
+}
+
+/* Gives the points that perturb_points() flagged in `found` up to
+ * GLITCH_ROUNDS more passes, each against a new reference placed on one
+ * of them; the few that are still glitched after that keep their
+ * approximate value. The offsets are from (real, imag), where `ref` starts,
+ * scaled by 2^-exponent. Point i ends up at index[i] of `out` (its
+ * glitched flags are not used); dcr, dci and index are reordered along
+ * the way, and the offsets become relative to the latest reference.
+ */
+void perturb_rebase(const Kernel* kernel, DeepDeltas deep_deltas, int max_iterations, OrbitFormat format,
+                    size_t orbit_budget, Worker* worker, mpf_srcptr real, mpf_srcptr imag, double* dcr, double* dci,
+                    int exponent, int* index, int count, const PerturbResults* found, const PerturbResults* out) {
+  size_t mark = arena_mark(&worker->arena);
+  ReferenceOrbit secondary = { 0 };
+  // Where the latest reference starts, from (real, imag) and scaled like the offsets.
+  real_t base_dcr = 0.0L;
+  real_t base_dci = 0.0L;
+  for (int round = 0; round <= GLITCH_ROUNDS; ++round) {
+    // Hand out the finished points, keep the glitched ones for another pass.
+    int remaining = 0;
+    for (int i = 0; i < count; ++i) {
+      if (found->glitched[i] && round < GLITCH_ROUNDS) {
+        dcr[remaining] = dcr[i];
+        dci[remaining] = dci[i];
+        index[remaining] = index[i];
+        remaining++;
+      } else {
+        perturb_copy(out, index[i], found, i);
+      }
+    }
+    if (remaining == 0) {
+      break;
+    }
+    count = remaining;
+    worker->rebased += round == 0 ? count : 0;
+
+    double ref_dcr = dcr[0];
+    double ref_dci = dci[0];
+    base_dcr += ref_dcr;
+    base_dci += ref_dci;
+    mpf_t cr, ci;
+    mpf_init2(cr, mpf_get_prec(real));
+    mpf_init2(ci, mpf_get_prec(imag));
+    mpf_set(cr, real);
+    mpf_set(ci, imag);
+    mpf_add_real(cr, ldexpl(base_dcr, exponent));
+    mpf_add_real(ci, ldexpl(base_dci, exponent));
+    orbit_release(&secondary);
+    arena_rewind(&worker->arena, mark);
+    reference_build(&secondary, format, cr, ci, max_iterations, &worker->arena, orbit_budget);
+    mpf_clear(cr);
+    mpf_clear(ci);
+
+    for (int i = 0; i < count; ++i) {
+      dcr[i] -= ref_dcr;
+      dci[i] -= ref_dci;
+    }
+    perturb_points(kernel, deep_deltas, max_iterations, worker, &secondary, dcr, dci, exponent, count, found);
+  }
+  orbit_release(&secondary);
+}
+
+/* Renders the listed pixels (indices into job->nu) as deltas from the
+ * frame's reference orbit (the view center), rebasing the glitched ones
+ * with perturb_rebase(). Past a pixel spacing of 2^DEEP_EXPONENT the
+ * offsets are kept scaled by 2^-exponent and iterated with the job's
+ * deep_deltas.
+ */
+void render_pixels_perturbation(const RenderJob* job, Worker* worker, const int* pixels, int count) {
+  const View* view = &job->view;
+  double* dcr = arena_alloc(&worker->arena, count * sizeof(*dcr));
+  double* dci = arena_alloc(&worker->arena, count * sizeof(*dci));
+  int* pixel = arena_alloc(&worker->arena, count * sizeof(*pixel));
+  PerturbResults found = {
+    .nu = arena_alloc(&worker->arena, count * sizeof(*found.nu)),
+    .glitched = arena_alloc(&worker->arena, count * sizeof(*found.glitched)),
+  };
+
+  int exponent = 0;
+  real_t spacing = fminl(view->scalex, view->scaley);
+  if (spacing < ldexpl(1.0L, DEEP_EXPONENT)) {
+    exponent = ilogbl(spacing);
+  }
+  double scalex = ldexpl(view->scalex, -exponent);
+  double scaley = ldexpl(view->scaley, -exponent);
+  for (int p = 0; p < count; ++p) {
+    int x = pixels[p] % view->image_width;
+    int y = pixels[p] / view->image_width;
+    dcr[p] = scalex * ((double)x + 0.5 - view->image_width * 0.5);
+    dci[p] = scaley * (view->image_height * 0.5 - (double)y - 0.5);
+    pixel[p] = pixels[p];
+  }
+
+  perturb_points(job->kernel, job->deep_deltas, job->max_iterations, worker, job->reference, dcr, dci, exponent,
+                 count, &found);
+  worker->iterated += count;
+  PerturbResults out = { .nu = job->nu };
+  perturb_rebase(job->kernel, job->deep_deltas, job->max_iterations, job->orbit_format, job->orbit_budget, worker,
+                 view->exact_real, view->exact_imag, dcr, dci, exponent, pixel, count, &found, &out);
+}
+
+/* Iterates the listed pixels (indices into job->nu) with the given
+ * backend. Their points are computed as in the grid kernels, so a pixel
+ * comes out the same whichever way it is rendered.
+ */
+void render_pixels(const RenderJob* job, Worker* worker, Precision precision, const int* pixels, int count) {
+  if (count == 0) {
+    return;
+  }
+  // Strategies call this many times per task, give the scratch back.
+  size_t mark = arena_mark(&worker->arena);
+  if (precision == PRECISION_PERTURBATION) {
+    render_pixels_perturbation(job, worker, pixels, count);
+    arena_rewind(&worker->arena, mark);
+    return;
+  }
+
+  const View* view = &job->view;
+  real_t* real = arena_alloc(&worker->arena, count * sizeof(*real));
+  real_t* imag = arena_alloc(&worker->arena, count * sizeof(*imag));
+  float* nu = arena_alloc(&worker->arena, count * sizeof(*nu));
+  for (int p = 0; p < count; ++p) {
+    int x = pixels[p] % view->image_width;
+    int y = view->image_height - pixels[p] / view->image_width - 1;
+    if (precision == PRECISION_FLOAT) {
+      real[p] = (float)view->scalex * ((float)x + 0.5f) + (float)view->real_min;
+      imag[p] = (float)view->scaley * ((float)y + 0.5f) + (float)view->imag_min;
+    } else if (precision == PRECISION_DOUBLE) {
+      real[p] = (double)view->scalex * ((double)x + 0.5f) + (double)view->real_min;
+      imag[p] = (double)view->scaley * ((double)y + 0.5f) + (double)view->imag_min;
+    } else {
+      real[p] = view->scalex * ((real_t)x + 0.5f) + view->real_min;
+      imag[p] = view->scaley * ((real_t)y + 0.5f) + view->imag_min;
+    }
+  }
+  PointSet points = { .real = real, .imag = imag, .count = count, .precision = precision };
+  PointResults results = { .nu = nu };
+  job->kernel->points[precision](&points, 0, count, job->max_iterations, &results);
+  worker->iterated += count;
+  for (int p = 0; p < count; ++p) {
+    job->nu[pixels[p]] = nu[p];
+  }
+  arena_rewind(&worker->arena, mark);
+}
+
+// Iterates the pixels of [x0, x1) x [y0, y1) with the given backend.
+void render_rect(const RenderJob* job, Worker* worker, Precision precision, int x0, int y0, int x1, int y1) {
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+  if (precision == PRECISION_PERTURBATION) {
+    size_t mark = arena_mark(&worker->arena);
+    int count = (x1 - x0) * (y1 - y0);
+    int* pixels = arena_alloc(&worker->arena, count * sizeof(*pixels));
+    int p = 0;
+    for (int y = y0; y < y1; ++y) {
+      for (int x = x0; x < x1; ++x) {
+        pixels[p++] = y * job->view.image_width + x;
+      }
+    }
+    render_pixels(job, worker, precision, pixels, count);
+    arena_rewind(&worker->arena, mark);
+  } else {
+    job->kernel->render[precision](job, x0, y0, x1, y1);
+    worker->iterated += (long long)(x1 - x0) * (y1 - y0);
+  }
+}
+
+// Whether two escape values lie in the same band: both interior, or escaped in the same iteration.
+static inline bool nu_same_band(float a, float b) {
+  return (a == -1.0f && b == -1.0f) || (a > -1.0f && b > -1.0f && floorf(a) == floorf(b));
+}
+
+// Whether all pixels on the border of the box [x0, x1] x [y0, y1] are interior.
+bool box_border_interior(const RenderJob* job, int x0, int y0, int x1, int y1) {
+  const float* nu = job->nu;
+  int stride = job->view.image_width;
+  for (int x = x0; x <= x1; ++x) {
+    if (nu[y0 * stride + x] != -1.0f || nu[y1 * stride + x] != -1.0f) {
+      return false;
+    }
+  }
+  for (int y = y0 + 1; y < y1; ++y) {
+    if (nu[y * stride + x0] != -1.0f || nu[y * stride + x1] != -1.0f) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Whether the task running on `worker` has taken long enough that idle workers should share it.
+bool split_wanted(const RenderJob* job, const Worker* worker) {
+  if (job->split != SPLIT_IDLE) {
+    return job->split == SPLIT_ALWAYS;
+  }
+  return atomic_load(&worker->pool->idle) > 0 && now_seconds() - worker->task_start > SPLIT_AFTER;
+}
+
+// Queues `count` pieces as new tasks of the job, unless there is no room left for them.
+bool render_hand_off(RenderJob* job, Worker* worker, const TilePiece* pieces, int count) {
+  PieceStack* stack = job->pieces;
+  mtx_lock(&stack->lock);
+  bool room = stack->count + count <= MAX_PIECES;
+  if (room) {
+    memcpy(&stack->pieces[stack->count], pieces, count * sizeof(*pieces));
+    stack->count += count;
+  }
+  mtx_unlock(&stack->lock);
+  if (room) {
+    pool_add_tasks(worker->pool, job->pool_job, count);
+  }
+  return room;
+}
+
+/* Fills the inside of the box [x0, x1] x [y0, y1], whose border is
+ * already iterated. The points that stay bounded for max_iterations
+ * steps form a region without holes (by the maximum modulus principle),
+ * so a box with an interior border is interior throughout and needs no
+ * iterating; only filaments thinner than a pixel that slip between the
+ * border samples get lost. Other boxes are split in four along a new
+ * cross of pixels, down to MARIANI_SILVER_MIN. Once the task runs long,
+ * three of the four go to idle workers.
+ */
+void mariani_silver(RenderJob* job, Worker* worker, Precision precision, int x0, int y0, int x1, int y1) {
+  if (x1 - x0 < 2 || y1 - y0 < 2) {
+    return;
+  }
+  if (box_border_interior(job, x0, y0, x1, y1)) {
+    for (int y = y0 + 1; y < y1; ++y) {
+      for (int x = x0 + 1; x < x1; ++x) {
+        job->nu[y * job->view.image_width + x] = -1.0f;
+      }
+    }
+    return;
+  }
+  if (x1 - x0 <= MARIANI_SILVER_MIN || y1 - y0 <= MARIANI_SILVER_MIN) {
+    render_rect(job, worker, precision, x0 + 1, y0 + 1, x1, y1);
+    return;
+  }
+
+  int xm = (x0 + x1) / 2;
+  int ym = (y0 + y1) / 2;
+  render_rect(job, worker, precision, xm, y0 + 1, xm + 1, y1);
+  render_rect(job, worker, precision, x0 + 1, ym, xm, ym + 1);
+  render_rect(job, worker, precision, xm + 1, ym, x1, ym + 1);
+  TilePiece boxes[] = {
+    { xm, y0, x1, ym, precision, true, 0, 0 },
+    { x0, ym, xm, y1, precision, true, 0, 0 },
+    { xm, ym, x1, y1, precision, true, 0, 0 },
+  };
+  if (!split_wanted(job, worker) || !render_hand_off(job, worker, boxes, 3)) {
+    for (int i = 0; i < 3; ++i) {
+      mariani_silver(job, worker, precision, boxes[i].x0, boxes[i].y0, boxes[i].x1, boxes[i].y1);
+    }
+  }
+  mariani_silver(job, worker, precision, x0, y0, xm, ym);
+}
+
+/* Gives the rows [y, y1) of a task that runs long to the idle workers,
+ * one share for each and one kept, and returns where the kept share
+ * ends. The frame has to come out the same wherever the tile is split:
+ * - With brute, shares start on a multiple of ROW_BAND, where
+ *   render_rows() ends a batch anyway, since a batch of perturbation
+ *   pixels rebases its glitches on one of its own pixels.
+ * - With guessing, y is a guessed row, and shares start after a row the
+ *   unsplit tile iterates. Those rows are iterated here before handing
+ *   off, so the guesses on either side of a cut see both neighbours.
+ */
+int render_split(RenderJob* job, Worker* worker, Precision precision, int x0, int y, int x1, int y1, int top,
+                 int bottom) {
+  int parts = job->split == SPLIT_ALWAYS ? SPLIT_MAX_PARTS : atomic_load(&worker->pool->idle) + 1;
+  parts = parts < SPLIT_MAX_PARTS ? parts : SPLIT_MAX_PARTS;
+  TilePiece pieces[SPLIT_MAX_PARTS - 1];
+  if (job->strategy == STRATEGY_GUESSING) {
+    if ((y1 - y) / SPLIT_MIN_ROWS < parts) {
+      parts = (y1 - y) / SPLIT_MIN_ROWS;
+    }
+    if (parts < 2) {
+      return y1;
+    }
+    // Rows y - 1 + i * share are at an even offset from top, like y - 1.
+    int share = (y1 - y) / parts & ~1;
+    for (int i = 1; i < parts; ++i) {
+      int cut = y - 1 + i * share;
+      render_rect(job, worker, precision, x0, cut, x1, cut + 1);
+      pieces[i - 1] = (TilePiece){ x0, cut + 1, x1, i == parts - 1 ? y1 : cut + share, precision, false, top, bottom };
+    }
+    return render_hand_off(job, worker, pieces, parts - 1) ? y - 1 + share : y1;
+  }
+  int first = (y + ROW_BAND - 1) / ROW_BAND * ROW_BAND;
+  int bands = first < y1 ? (y1 - first) / ROW_BAND : 0;
+  if (bands * ROW_BAND / SPLIT_MIN_ROWS < parts) {
+    parts = bands * ROW_BAND / SPLIT_MIN_ROWS;
+  }
+  parts = parts < bands ? parts : bands;
+  if (parts < 2) {
+    return y1;
+  }
+  int share = bands / parts * ROW_BAND;
+  for (int i = 1; i < parts; ++i) {
+    pieces[i - 1] = (TilePiece){ x0, first + i * share, x1, i == parts - 1 ? y1 : first + (i + 1) * share, precision,
+                                 false, top, bottom };
+  }
+  return render_hand_off(job, worker, pieces, parts - 1) ? first + share : y1;
+}
+
+/* Iterates [x0, x1) x [y0, y1) top down with the brute or guessing
+ * strategy, giving the rows it has not reached yet away once it runs
+ * long. The rows are part of the area [top, bottom). Guessing iterates
+ * the rows at an even offset from top and takes each pixel of the row
+ * in between from its neighbours above and below if both are interior
+ * or both escaped in the same iteration; the rest of the row is
+ * iterated in runs. This trades exactness on features thinner than two
+ * pixels for skipping up to half of the area. A share of the rows that
+ * starts or ends on a guessed row finds the iterated one next to it
+ * done already, see render_split().
+ */
+void render_rows(RenderJob* job, Worker* worker, Precision precision, int x0, int y0, int x1, int y1, int top,
+                 int bottom) {
+  float* nu = job->nu;
+  int stride = job->view.image_width;
+  int y = y0;
+  while (y < y1) {
+    if (job->strategy != STRATEGY_GUESSING) {
+      // Batches end on multiples of ROW_BAND, see render_split().
+      int end = (y / ROW_BAND + 1) * ROW_BAND;
+      end = end < y1 ? end : y1;
+      render_rect(job, worker, precision, x0, y, x1, end);
+      y = end;
+    } else if ((y - top) % 2 == 0 || y + 1 == bottom) {
+      // The rows guessing iterates, and a last one that has no neighbour below.
+      render_rect(job, worker, precision, x0, y, x1, y + 1);
+      y++;
+    } else {
+      // Row y - 1 is done, and so is y + 1 if it is past the share; guess y in between.
+      if (y + 1 < y1) {
+        render_rect(job, worker, precision, x0, y + 1, x1, y + 2);
+      }
+      int run = -1;
+      for (int x = x0; x <= x1; ++x) {
+        bool guessed = false;
+        if (x < x1) {
+          float above = nu[(y - 1) * stride + x];
+          float below = nu[(y + 1) * stride + x];
+          if (nu_same_band(above, below)) {
+            nu[y * stride + x] = 0.5f * (above + below);
+            guessed = true;
+          }
+        }
+        if (!guessed && x < x1 && run < 0) {
+          run = x;
+        } else if ((guessed || x == x1) && run >= 0) {
+          render_rect(job, worker, precision, run, y, x, y + 1);
+          run = -1;
+        }
+      }
+      y += 2;
+    }
+    if (y < y1 && split_wanted(job, worker)) {
+      y1 = render_split(job, worker, precision, x0, y, x1, y1, top, bottom);
+    }
+  }
+}
+
+enum {
+  TRACE_DONE = 1,    // iterated
+  TRACE_QUEUED = 2,  // compared with its neighbours, or about to be
+};
+
+/* Boundary tracing: starting from the border of the tile, follows the
+ * boundaries between bands (see nu_same_band()) inwards. Every pixel on
+ * the wave gets its four neighbours iterated; those in another band are
+ * on a boundary and join the next wave, along with the diagonal between
+ * two of them. What the boundaries enclose is never reached and is
+ * filled row by row, interpolating between the iterated pixels on either
+ * side, which are in the same band. Pixels are iterated a wave at a
+ * time, so the kernels see batches rather than single pixels.
+ *
+ * The border of every tile is iterated, so tiles need nothing from
+ * their neighbours and agree along the seams. Like mariani_silver(), it
+ * loses islands of another band that no boundary from the border leads to.
+ */
+void boundary_trace(RenderJob* job, Worker* worker, Precision precision, int x0, int y0, int x1, int y1) {
+  int width = x1 - x0;
+  int height = y1 - y0;
+  int area = width * height;
+  int stride = job->view.image_width;
+  float* nu = job->nu;
+  uint8_t* flags = arena_alloc(&worker->arena, area * sizeof(*flags));
+  int* wave = arena_alloc(&worker->arena, area * sizeof(*wave));
+  int* next = arena_alloc(&worker->arena, area * sizeof(*next));
+  int* batch = arena_alloc(&worker->arena, area * sizeof(*batch));
+  memset(flags, 0, area * sizeof(*flags));
+
+  // Tile-local indices, l = (y - y0) * width + (x - x0).
+  int wave_count = 0;
+  for (int l = 0; l < area; ++l) {
+    int x = l % width;
+    int y = l / width;
+    if (x == 0 || y == 0 || x == width - 1 || y == height - 1) {
+      flags[l] = TRACE_QUEUED;
+      wave[wave_count++] = l;
+    }
+  }
+
+  while (wave_count > 0) {
+    int batch_count = 0;
+    for (int i = 0; i < wave_count; ++i) {
+      int l = wave[i];
+      int x = l % width;
+      int y = l / width;
+      int around[5] = { l, x > 0 ? l - 1 : -1, x + 1 < width ? l + 1 : -1,
+                        y > 0 ? l - width : -1, y + 1 < height ? l + width : -1 };
+      for (int k = 0; k < 5; ++k) {
+        if (around[k] >= 0 && !(flags[around[k]] & TRACE_DONE)) {
+          flags[around[k]] |= TRACE_DONE;
+          batch[batch_count++] = (y0 + around[k] / width) * stride + x0 + around[k] % width;
+        }
+      }
+    }
+    render_pixels(job, worker, precision, batch, batch_count);
+
+    int next_count = 0;
+    for (int i = 0; i < wave_count; ++i) {
+      int l = wave[i];
+      int x = l % width;
+      int y = l / width;
+      float* center = &nu[(y0 + y) * stride + x0 + x];
+      bool left = x > 0 && !nu_same_band(*center, center[-1]);
+      bool right = x + 1 < width && !nu_same_band(*center, center[1]);
+      bool up = y > 0 && !nu_same_band(*center, center[-stride]);
+      bool down = y + 1 < height && !nu_same_band(*center, center[stride]);
+      int queue[8] = {
+        left ? l - 1 : -1,
+        right ? l + 1 : -1,
+        up ? l - width : -1,
+        down ? l + width : -1,
+        (up || left) && x > 0 && y > 0 ? l - width - 1 : -1,
+        (up || right) && x + 1 < width && y > 0 ? l - width + 1 : -1,
+        (down || left) && x > 0 && y + 1 < height ? l + width - 1 : -1,
+        (down || right) && x + 1 < width && y + 1 < height ? l + width + 1 : -1,
+      };
+      for (int k = 0; k < 8; ++k) {
+        if (queue[k] >= 0 && !(flags[queue[k]] & TRACE_QUEUED)) {
+          flags[queue[k]] |= TRACE_QUEUED;
+          next[next_count++] = queue[k];
+        }
+      }
+    }
+    int* swap = wave;
+    wave = next;
+    next = swap;
+    wave_count = next_count;
+  }
+
+  // The first and last pixel of every row are on the tile border, so every run has both ends.
+  for (int y = 1; y + 1 < height; ++y) {
+    float* row = &nu[(y0 + y) * stride + x0];
+    const uint8_t* row_flags = &flags[y * width];
+    int x = 1;
+    while (x + 1 < width) {
+      if (row_flags[x] & TRACE_DONE) {
+        x++;
+        continue;
+      }
+      int end = x;
+      while (!(row_flags[end] & TRACE_DONE)) {
+        end++;
+      }
+      float a = row[x - 1];
+      float b = row[end];
+      for (int i = x; i < end; ++i) {
+        row[i] = a + (b - a) * (float)(i - x + 1) / (float)(end - x + 1);
+      }
+      x = end;
+    }
+  }
+}
+
+/* With --certify, tries to fill the tile [x0, x1) x [y0, y1) without
+ * iterating it, from certify_disk() over a disk of c around it. The
+ * disk reaches the corners of the pixels on the edge, half a pixel past
+ * the centers the kernels iterate, which is plenty for how they round
+ * them. An interior tile is filled with -1. A tile that escapes on a
+ * single step is in at most two bands, and its smooth value varies
+ * slowly away from the set, so only its corners are iterated and the
+ * rest is interpolated between them. Perturbation tiles are not tried (see
+ * render_tile()): their c does not fit a long double.
+ */
+bool certify_tile(RenderJob* job, Worker* worker, Precision precision, int x0, int y0, int x1, int y1) {
+  const View* view = &job->view;
+  real_t half_width = view->scalex * (x1 - x0) * 0.5L;
+  real_t half_height = view->scaley * (y1 - y0) * 0.5L;
+  real_t center_real = view->real_min + view->scalex * x0 + half_width;
+  real_t center_imag = view->imag_min + view->scaley * (view->image_height - y1) + half_height;
+  Disk c = { (double)center_real, (double)center_imag, 0.0 };
+  // The corners, and how far rounding the center to double moved it.
+  c.radius = bound_up(hypot((double)half_width, (double)half_height) + (double)(fabsl(center_real - c.real) + fabsl(center_imag - c.imag)));
+  int escape = certify_disk(c, job->max_iterations);
+  if (escape < 0) {
+    return false;
+  }
+
+  float* nu = job->nu;
+  int stride = view->image_width;
+  if (escape == 0) {
+    for (int y = y0; y < y1; ++y) {
+      for (int x = x0; x < x1; ++x) {
+        nu[y * stride + x] = -1.0f;
+      }
+    }
+  } else {
+    int corners[4] = { y0 * stride + x0, y0 * stride + x1 - 1, (y1 - 1) * stride + x0, (y1 - 1) * stride + x1 - 1 };
+    render_pixels(job, worker, precision, corners, 4);
+    float top_left = nu[corners[0]], top_right = nu[corners[1]];
+    float bottom_left = nu[corners[2]], bottom_right = nu[corners[3]];
+    for (int y = y0; y < y1; ++y) {
+      float ty = y1 - 1 > y0 ? (float)(y - y0) / (float)(y1 - 1 - y0) : 0.0f;
+      for (int x = x0; x < x1; ++x) {
+        float tx = x1 - 1 > x0 ? (float)(x - x0) / (float)(x1 - 1 - x0) : 0.0f;
+        float top = top_left + (top_right - top_left) * tx;
+        float bottom = bottom_left + (bottom_right - bottom_left) * tx;
+        nu[y * stride + x] = top + (bottom - top) * ty;
+      }
+    }
+  }
+  atomic_fetch_add(&job->certified, (long long)(x1 - x0) * (y1 - y0));
+  return true;
+}
+
+// Renders [x0, x1) x [y0, y1) of a tile with the job's strategy.
+void render_area(RenderJob* job, Worker* worker, Precision precision, int x0, int y0, int x1, int y1) {
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+  if (job->strategy == STRATEGY_MARIANI_SILVER) {
+    render_rect(job, worker, precision, x0, y0, x1, y0 + 1);
+    render_rect(job, worker, precision, x0, y1 - 1, x1, y1);
+    render_rect(job, worker, precision, x0, y0 + 1, x0 + 1, y1 - 1);
+    render_rect(job, worker, precision, x1 - 1, y0 + 1, x1, y1 - 1);
+    mariani_silver(job, worker, precision, x0, y0, x1 - 1, y1 - 1);
+  } else if (job->strategy == STRATEGY_BOUNDARY) {
+    boundary_trace(job, worker, precision, x0, y0, x1, y1);
+  } else {
+    render_rows(job, worker, precision, x0, y0, x1, y1, y0, y1);
+  }
+}
+
+/* Renders [x0, x1) x [y0, y1), which certify_tile() could not fill as a
+ * whole, by trying its quarters, down to CERTIFY_MIN pixels. Quarters
+ * that are not filled either are rendered with the job's strategy. If
+ * none of the four is, the area is rendered in one piece instead, which
+ * keeps the strategy from working on scraps along the boundary of the
+ * set, where nothing gets certified anyway.
+ */
+void render_certified(RenderJob* job, Worker* worker, Precision precision, int x0, int y0, int x1, int y1) {
+  if (x1 - x0 < 2 * CERTIFY_MIN || y1 - y0 < 2 * CERTIFY_MIN) {
+    render_area(job, worker, precision, x0, y0, x1, y1);
+    return;
+  }
+  int xm = (x0 + x1) / 2;
+  int ym = (y0 + y1) / 2;
+  int quarters[4][4] = { { x0, y0, xm, ym }, { xm, y0, x1, ym }, { x0, ym, xm, y1 }, { xm, ym, x1, y1 } };
+  bool filled[4];
+  int filled_count = 0;
+  for (int q = 0; q < 4; ++q) {
+    filled[q] = certify_tile(job, worker, precision, quarters[q][0], quarters[q][1], quarters[q][2], quarters[q][3]);
+    filled_count += filled[q];
+  }
+  if (filled_count == 0) {
+    render_area(job, worker, precision, x0, y0, x1, y1);
+    return;
+  }
+  for (int q = 0; q < 4; ++q) {
+    if (!filled[q]) {
+      render_certified(job, worker, precision, quarters[q][0], quarters[q][1], quarters[q][2], quarters[q][3]);
+    }
+  }
+}
+
+/* Notes that the first pixels of `generation` are done. Every generation
+ * has a slot of its own, so a later frame does not overwrite the time of
+ * one the main thread has not looked at yet.
+ */
+void progress_record(State* state, uint64_t generation) {
+  ProgressMark* mark = &state->progress[generation % PROGRESS_SLOTS];
+  atomic_store(&mark->time, now_seconds());
+  atomic_store(&mark->generation, generation);
+  atomic_store(&state->progress_generation, generation);
+}
+
+/* When the first pixels of the earliest frame that includes `generation`
+ * were done, or 0 if there is none yet.
+ */
+double progress_time(State* state, uint64_t generation) {
+  uint64_t latest = atomic_load(&state->progress_generation);
+  if (latest >= PROGRESS_SLOTS && generation <= latest - PROGRESS_SLOTS) {
+    generation = latest - PROGRESS_SLOTS + 1;
+  }
+  for (; generation <= latest; ++generation) {
+    ProgressMark* mark = &state->progress[generation % PROGRESS_SLOTS];
+    if (atomic_load(&mark->generation) == generation) {
+      return atomic_load(&mark->time);
+    }
+  }
+  return 0.0;
+}
+
+// The pixels [x0, x1) x [y0, y1) of tile `task`.
+void tile_bounds(const RenderJob* job, int task, int* x0, int* y0, int* x1, int* y1) {
+  *x0 = (task % job->tiles_x) * job->tile_size;
+  *y0 = (task / job->tiles_x) * job->tile_size;
+  *x1 = *x0 + job->tile_size < job->view.image_width ? *x0 + job->tile_size : job->view.image_width;
+  *y1 = *y0 + job->tile_size < job->view.image_height ? *y0 + job->tile_size : job->view.image_height;
+}
+
+void render_tile(Job* pool_job, int task, Worker* worker) {
+  RenderJob* job = pool_job->context;
+  if (job->cancel != NULL && atomic_load(job->cancel)) {
+    return;
+  }
+  if (task >= job->tile_count) {
+    mtx_lock(&job->pieces->lock);
+    TilePiece piece = job->pieces->pieces[--job->pieces->count];
+    mtx_unlock(&job->pieces->lock);
+    if (piece.box) {
+      mariani_silver(job, worker, piece.precision, piece.x0, piece.y0, piece.x1, piece.y1);
+    } else {
+      render_rows(job, worker, piece.precision, piece.x0, piece.y0, piece.x1, piece.y1, piece.top, piece.bottom);
+    }
+    return;
+  }
+
+  int x0, y0, x1, y1;
+  tile_bounds(job, task, &x0, &y0, &x1, &y1);
+  Precision precision = job->sensitive != NULL ? tile_fast_precision(&job->view, x0, y0, x1, y1)
+                                               : tile_precision(&job->view, x0, y0, x1, y1);
+  bool skipping = job->skip_x0 < x1 && x0 < job->skip_x1 && job->skip_y0 < y1 && y0 < job->skip_y1;
+  if (job->certify && !skipping && precision != PRECISION_PERTURBATION) {
+    if (!certify_tile(job, worker, precision, x0, y0, x1, y1)) {
+      render_certified(job, worker, precision, x0, y0, x1, y1);
+    }
+  } else if (skipping) {
+    // Only the bands above and below the skipped pixels, and the sides in between.
+    int top = job->skip_y0 > y0 ? job->skip_y0 : y0;
+    int bottom = job->skip_y1 < y1 ? job->skip_y1 : y1;
+    int left = job->skip_x0 > x0 ? job->skip_x0 : x0;
+    int right = job->skip_x1 < x1 ? job->skip_x1 : x1;
+    render_area(job, worker, precision, x0, y0, x1, top);
+    render_area(job, worker, precision, x0, bottom, x1, y1);
+    render_area(job, worker, precision, x0, top, left, bottom);
+    render_area(job, worker, precision, right, top, x1, bottom);
+  } else {
+    render_area(job, worker, precision, x0, y0, x1, y1);
+  }
+
+  if (job->state != NULL && !atomic_exchange(&job->first_tile_done, true)) {
+    progress_record(job->state, job->generation);
+  }
+}
+
+/* Flags the pixels of a tile whose first pass under --mixed-precision
+ * may be off. Rounding errors grow along an orbit about as fast as its
+ * derivative dz/dc, so the error in nu is estimated as
+ *   iterations * eps * max(|c|, 2) * |dnu/dc|
+ * with eps the first pass's, and |dnu/dc| taken from the largest step to
+ * a neighbouring pixel over the spacing. Interior pixels count as
+ * max_iterations, so those next to escaped ones, late escapes and steep
+ * neighbourhoods all come out large. A pixel is recomputed when the
+ * estimate is past MIXED_TOLERANCE, or past the distance to the next
+ * band, which a pixel that barely escaped is close to.
+ */
+void refine_flag(Job* pool_job, int task, Worker* worker) {
+  (void)worker;
+  static const real_t epsilon[PRECISION_PERTURBATION] = { FLT_EPSILON, DBL_EPSILON, LDBL_EPSILON };
+  RenderJob* job = pool_job->context;
+  const View* view = &job->view;
+  int x0, y0, x1, y1;
+  tile_bounds(job, task, &x0, &y0, &x1, &y1);
+  int stride = view->image_width;
+  Precision fast = tile_fast_precision(view, x0, y0, x1, y1);
+  if (fast == tile_precision(view, x0, y0, x1, y1) || (job->cancel != NULL && atomic_load(job->cancel))) {
+    for (int y = y0; y < y1; ++y) {
+      memset(&job->sensitive[y * stride + x0], 0, x1 - x0);
+    }
+    return;
+  }
+
+  const float* nu = job->nu;
+  float limit = (float)job->max_iterations;
+  double scale = (double)(epsilon[fast] * tile_magnitude(view, x0, y0, x1, y1) /
+                          fminl(view->scalex, view->scaley));
+  for (int y = y0; y < y1; ++y) {
+    for (int x = x0; x < x1; ++x) {
+      int i = y * stride + x;
+      bool skipped = job->skip_x0 <= x && x < job->skip_x1 && job->skip_y0 <= y && y < job->skip_y1;
+      float value = nu[i] == -1.0f ? limit : nu[i];
+      float neighbours[4] = {
+        x > 0 ? nu[i - 1] : nu[i],
+        x + 1 < view->image_width ? nu[i + 1] : nu[i],
+        y > 0 ? nu[i - stride] : nu[i],
+        y + 1 < view->image_height ? nu[i + stride] : nu[i],
+      };
+      float step = 0.0f;
+      for (int k = 0; k < 4; ++k) {
+        step = fmaxf(step, fabsf(value - (neighbours[k] == -1.0f ? limit : neighbours[k])));
+      }
+      double error = fmax(value, 1.0f) * scale * step;
+      double edge = nu[i] == -1.0f ? INFINITY : fmin(nu[i] - floorf(nu[i]), ceilf(nu[i]) - nu[i]);
+      job->sensitive[i] = !skipped && (error > MIXED_TOLERANCE || error > edge);
+    }
+  }
+}
+
+// Recomputes the flagged pixels of a tile with the backend tile_precision() picks for it.
+void refine_tile(Job* pool_job, int task, Worker* worker) {
+  RenderJob* job = pool_job->context;
+  if (job->cancel != NULL && atomic_load(job->cancel)) {
+    return;
+  }
+  int x0, y0, x1, y1;
+  tile_bounds(job, task, &x0, &y0, &x1, &y1);
+  int* pixels = arena_alloc(&worker->arena, (x1 - x0) * (y1 - y0) * sizeof(*pixels));
+  int count = 0;
+  for (int y = y0; y < y1; ++y) {
+    for (int x = x0; x < x1; ++x) {
+      int i = y * job->view.image_width + x;
+      if (job->sensitive[i]) {
+        pixels[count++] = i;
+      }
+    }
+  }
+  render_pixels(job, worker, tile_precision(&job->view, x0, y0, x1, y1), pixels, count);
+  atomic_fetch_add(&job->refined, count);
+}
+
+/* The second pass of --mixed-precision over a rendered job: flags every
+ * pixel first, then recomputes the flagged ones, so that no tile reads
+ * its neighbours' pixels while they change.
+ */
+void refine_run(RenderPool* pool, RenderJob* job) {
+  Job flag = {
+    .run = refine_flag,
+    .context = job,
+    .task_count = job->tile_count,
+  };
+  pool_run(pool, &flag);
+  Job refine = {
+    .run = refine_tile,
+    .context = job,
+    .task_count = job->tile_count,
+  };
+  pool_run(pool, &refine);
+  job->busy_time += flag.busy_time + refine.busy_time;
+}
+
+/* Runs `job` over its view, one pool task per tile and one more for
+ * every piece a slow tile gives away, then refines it with
+ * --mixed-precision. The pieces are kept in `scratch`.
+ */
+void render_job_run(RenderPool* pool, RenderJob* job, Arena* scratch) {
+  int tiles_y = (job->view.image_height + job->tile_size - 1) / job->tile_size;
+  job->tile_count = job->tiles_x * tiles_y;
+  job->pieces = arena_alloc(scratch, sizeof(*job->pieces));
+  job->pieces->count = 0;
+  Job pool_job = {
+    .run = render_tile,
+    .context = job,
+    .task_count = job->tile_count,
+  };
+  job->pool_job = &pool_job;
+  mtx_init(&job->pieces->lock, mtx_plain);
+  pool_run(pool, &pool_job);
+  job->busy_time = pool_job.busy_time;
+  mtx_destroy(&job->pieces->lock);
+  if (job->sensitive != NULL) {
+    refine_run(pool, job);
+  }
+}
+
+typedef struct {
+  const Kernel* kernel;
+  DeepDeltas deep_deltas;
+  int max_iterations;
+  size_t orbit_budget;
+  const PointSet* points;
+  const PointResults* results;
+} PointsJob;
+
+void points_batch(Job* pool_job, int task, Worker* worker) {
+  PointsJob* job = pool_job->context;
+  const PointSet* points = job->points;
+  int first = task * POINTS_BATCH;
+  int count = points->count - first < POINTS_BATCH ? points->count - first : POINTS_BATCH;
+  if (points->precision != PRECISION_PERTURBATION) {
+    job->kernel->points[points->precision](points, first, count, job->max_iterations, job->results);
+    return;
+  }
+
+  // Scaled as in render_tile_perturbation(), by the largest offset of the batch.
+  real_t largest = 0.0L;
+  for (int p = first; p < first + count; ++p) {
+    largest = fmaxl(largest, fmaxl(fabsl(points->real[p]), fabsl(points->imag[p])));
+  }
+  int exponent = 0;
+  if (largest > 0.0L && largest < ldexpl(1.0L, DEEP_EXPONENT)) {
+    exponent = ilogbl(largest);
+  }
+  double* dcr = arena_alloc(&worker->arena, count * sizeof(*dcr));
+  double* dci = arena_alloc(&worker->arena, count * sizeof(*dci));
+  int* index = arena_alloc(&worker->arena, count * sizeof(*index));
+  for (int p = 0; p < count; ++p) {
+    dcr[p] = ldexpl(points->real[first + p], -exponent);
+    dci[p] = ldexpl(points->imag[first + p], -exponent);
+    index[p] = p;
+  }
+  // Found per point of the batch and handed out by point_finish(), as in the other point kernels.
+  bool derivative = job->results->distance != NULL;
+  PerturbResults found[2];
+  for (int k = 0; k < 2; ++k) {
+    found[k] = (PerturbResults){
+      .nu = arena_alloc(&worker->arena, count * sizeof(*found[k].nu)),
+      .glitched = arena_alloc(&worker->arena, count * sizeof(*found[k].glitched)),
+      .iterations = arena_alloc(&worker->arena, count * sizeof(*found[k].iterations)),
+      .zr = derivative ? arena_alloc(&worker->arena, count * sizeof(*found[k].zr)) : NULL,
+      .zi = derivative ? arena_alloc(&worker->arena, count * sizeof(*found[k].zi)) : NULL,
+      .dr = derivative ? arena_alloc(&worker->arena, count * sizeof(*found[k].dr)) : NULL,
+      .di = derivative ? arena_alloc(&worker->arena, count * sizeof(*found[k].di)) : NULL,
+    };
+  }
+  perturb_points(job->kernel, job->deep_deltas, job->max_iterations, worker, points->reference, dcr, dci,
+                 exponent, count, &found[0]);
+  perturb_rebase(job->kernel, job->deep_deltas, job->max_iterations, points->reference->format, job->orbit_budget,
+                 worker, points->reference_real, points->reference_imag, dcr, dci, exponent, index, count,
+                 &found[0], &found[1]);
+
+  const PerturbResults* out = &found[1];
+  double reference_real = mpf_get_d(points->reference_real);
+  double reference_imag = mpf_get_d(points->reference_imag);
+  for (int p = 0; p < count; ++p) {
+    double cr = reference_real + (double)points->real[first + p];
+    double ci = reference_imag + (double)points->imag[first + p];
+    point_finish(job->results, first + p, out->iterations[p] >= 0, out->iterations[p], out->nu[p],
+                 derivative ? out->zr[p] : 0.0, derivative ? out->zi[p] : 0.0, derivative ? out->dr[p] : 0.0,
+                 derivative ? out->di[p] : 0.0, cr, ci);
+  }
+}
+
+/* Evaluates an arbitrary set of points on the pool, POINTS_BATCH points
+ * per task, through the same kernels as render. Orbits for rebasing
+ * glitched points are held to `orbit_budget` as in render.
+ */
+void points_evaluate(RenderPool* pool, const Kernel* kernel, DeepDeltas deep_deltas, const PointSet* points,
+                     int max_iterations, size_t orbit_budget, const PointResults* results) {
+  PointsJob job = {
+    .kernel = kernel,
+    .deep_deltas = deep_deltas,
+    .max_iterations = max_iterations,
+    .orbit_budget = orbit_budget,
+    .points = points,
+    .results = results,
+  };
+  Job pool_job = {
+    .run = points_batch,
+    .context = &job,
+    .task_count = (points->count + POINTS_BATCH - 1) / POINTS_BATCH,
+  };
+  if (pool_job.task_count > 0) {
+    pool_run(pool, &pool_job);
+  }
+}
+
+static int compare_floats(const void* a, const void* b) {
+  float x = *(const float*)a;
+  float y = *(const float*)b;
+  return (x > y) - (x < y);
+}
+
+/* Evaluates the cell centers of a PROBE_WIDTH x PROBE_HEIGHT grid spread
+ * over the view as a PointSet, up to PROBE_LIMIT_FACTOR times the usual
+ * limit, and picks the iteration
+ * limit and strategy for the frame from it. The limit is set to cover
+ * the slowest escapes the probe saw with some margin. The cost model
+ * counts iterations:
+ *   brute          - interior pixels cost the limit, escaped ones their mean
+ *   mariani-silver - skips most of the area where whole probe cells are interior
+ *   guessing       - skips half of the area where vertical probe neighbours agree
+ * Both probe-based shares are measured 25 pixels apart and so
+ * underestimate what the strategies find at pixel scale.
+ */
+void plan_frame(RenderPool* pool, RenderJob* job, bool log) {
+  enum { SAMPLES = PROBE_WIDTH * PROBE_HEIGHT };
+  View probe_view = job->view;
+  probe_view.image_width = PROBE_WIDTH;
+  probe_view.image_height = PROBE_HEIGHT;
+  probe_view.scalex = job->view.width / PROBE_WIDTH;
+  probe_view.scaley = job->view.height / PROBE_HEIGHT;
+  Precision precision = tile_precision(&probe_view, 0, 0, PROBE_WIDTH, PROBE_HEIGHT);
+  if (precision == PRECISION_PERTURBATION && job->reference == NULL) {
+    precision = PRECISION_LONG_DOUBLE;
+  }
+
+  // Cell centers, as offsets from the view center for perturbation.
+  real_t real[SAMPLES];
+  real_t imag[SAMPLES];
+  for (int y = 0; y < PROBE_HEIGHT; ++y) {
+    for (int x = 0; x < PROBE_WIDTH; ++x) {
+      real_t offset_real = probe_view.scalex * (x + 0.5L - PROBE_WIDTH * 0.5L);
+      real_t offset_imag = probe_view.scaley * (PROBE_HEIGHT * 0.5L - y - 0.5L);
+      bool relative = precision == PRECISION_PERTURBATION;
+      real[y * PROBE_WIDTH + x] = relative ? offset_real : probe_view.center_real + offset_real;
+      imag[y * PROBE_WIDTH + x] = relative ? offset_imag : probe_view.center_imag + offset_imag;
+    }
+  }
+  PointSet points = {
+    .real = real,
+    .imag = imag,
+    .count = SAMPLES,
+    .precision = precision,
+    .reference = job->reference,
+    .reference_real = job->view.exact_real,
+    .reference_imag = job->view.exact_imag,
+  };
+  float nu[SAMPLES];
+  PointResults results = { .nu = nu };
+  int probe_limit = job->max_iterations * PROBE_LIMIT_FACTOR;
+  points_evaluate(pool, job->kernel, job->deep_deltas, &points, probe_limit, job->orbit_budget, &results);
+
+  float escaped[SAMPLES];
+  int escaped_count = 0;
+  for (int i = 0; i < SAMPLES; ++i) {
+    if (nu[i] > -1.0f) {
+      escaped[escaped_count++] = nu[i];
+    }
+  }
+  qsort(escaped, escaped_count, sizeof(*escaped), compare_floats);
+
+  int limit = job->max_iterations;
+  if (escaped_count > 0) {
+    float slowest = escaped[(int)(0.99f * (escaped_count - 1))];
+    limit = (int)(slowest * 1.5f);
+    limit = limit < MIN_ITERATIONS ? MIN_ITERATIONS : limit;
+    limit = limit > probe_limit ? probe_limit : limit;
+  }
+
+  // Statistics at the chosen limit.
+  double escape_sum = 0.0;
+  int interior = 0;
+  for (int i = 0; i < SAMPLES; ++i) {
+    if (nu[i] > -1.0f && nu[i] < limit) {
+      escape_sum += nu[i] > 0.0f ? nu[i] : 0.0f;
+    } else {
+      interior++;
+      nu[i] = -1.0f;
+    }
+  }
+  int solid = 0;
+  int agreeing = 0;
+  for (int y = 0; y + 1 < PROBE_HEIGHT; ++y) {
+    for (int x = 0; x < PROBE_WIDTH; ++x) {
+      float a = nu[y * PROBE_WIDTH + x];
+      float b = nu[(y + 1) * PROBE_WIDTH + x];
+      agreeing += (a == -1.0f && b == -1.0f) || (a > -1.0f && b > -1.0f && floorf(a) == floorf(b));
+      if (x + 1 < PROBE_WIDTH) {
+        solid += a == -1.0f && b == -1.0f && nu[y * PROBE_WIDTH + x + 1] == -1.0f &&
+                 nu[(y + 1) * PROBE_WIDTH + x + 1] == -1.0f;
+      }
+    }
+  }
+
+  double pixels = (double)job->view.image_width * job->view.image_height;
+  double interior_share = (double)interior / SAMPLES;
+  double mean_escape = escape_sum / (SAMPLES - interior > 0 ? SAMPLES - interior : 1);
+  double solid_share = (double)solid / ((PROBE_WIDTH - 1) * (PROBE_HEIGHT - 1));
+  double agreeing_share = (double)agreeing / (PROBE_WIDTH * (PROBE_HEIGHT - 1));
+
+  double cost[STRATEGY_COUNT] = { 0 };
+  cost[STRATEGY_BRUTE] = pixels * (interior_share * limit + (1.0 - interior_share) * mean_escape);
+  // Borders and subdivision crosses are iterated anyway, and a kernel
+  // call per line of pixels keeps the vector lanes less full.
+  cost[STRATEGY_MARIANI_SILVER] = (cost[STRATEGY_BRUTE] - pixels * solid_share * limit * 0.8) * 1.25;
+  cost[STRATEGY_GUESSING] = cost[STRATEGY_BRUTE] * (1.0 - 0.5 * agreeing_share) * 1.05;
+
+  // Boundary tracing is only ever picked by hand.
+  Strategy best = STRATEGY_BRUTE;
+  for (int strategy = STRATEGY_BRUTE; strategy <= STRATEGY_GUESSING; ++strategy) {
+    if (cost[strategy] < cost[best]) {
+      best = strategy;
+    }
+  }
+  job->max_iterations = limit;
+  job->strategy = best;
+
+  if (log) {
+    printf("[STRATEGY] probe %dx%d: interior %.1f%%, mean escape %.1f, p99 escape %.1f -> limit %d, %s "
+           "(iterations: brute %.3g, mariani-silver %.3g, guessing %.3g)\n",
+           PROBE_WIDTH, PROBE_HEIGHT, interior_share * 100.0, mean_escape,
+           escaped_count > 0 ? escaped[(int)(0.99f * (escaped_count - 1))] : 0.0f, limit,
+           strategy_names[best], cost[STRATEGY_BRUTE], cost[STRATEGY_MARIANI_SILVER], cost[STRATEGY_GUESSING]);
+  }
+}
+
+/* Iterates the whole view into nu, one pool task per tile, and returns
+ * the iteration limit it used. Scratch that lives as long as the frame,
+ * like the reference orbit, comes out of `scratch`. `metrics` may be NULL.
+ * Unless `keep` is NULL, the reference orbit is left to the caller in
+ * *keep (NULL if there is none), to pass on to render_margin() and
+ * release along with `scratch`.
+ */
+int render_view(RenderPool* pool, const Settings* settings, const View* view, float* nu,
+                Arena* scratch, State* state, uint64_t generation, FrameMetrics* metrics, ReferenceOrbit** keep) {
+  double start = now_seconds();
+  /* The probe may raise the limit, so the reference is set out for the
+   * most it can ask, and cut short once the limit is known. It is
+   * streamed: the probe and then the tiles run while it is computed.
+   */
+  int max_iterations = view_max_iterations(view);
+  OrbitFormat orbit_format = settings->compact_orbit ? ORBIT_FLOAT : ORBIT_DOUBLE;
+  ReferenceOrbit* reference = NULL;
+  ReferenceStream stream;
+  Precision precision = tile_precision(view, 0, 0, view->image_width, view->image_height);
+  if (precision == PRECISION_PERTURBATION) {
+    reference = arena_alloc(scratch, sizeof(*reference));
+    reference_stream(&stream, reference, orbit_format, view->exact_real, view->exact_imag,
+                     max_iterations * PROBE_LIMIT_FACTOR, scratch, settings->orbit_budget);
+  }
+
+  // A shallow copy: the job only reads the view, and *view outlives it.
+  RenderJob job = {
+    .view = *view,
+    .max_iterations = max_iterations,
+    .strategy = settings->strategy,
+    .tile_size = settings->tile_size,
+    .tiles_x = (view->image_width + settings->tile_size - 1) / settings->tile_size,
+    .split = settings->split,
+    .kernel = &kernels[settings->kernel],
+    .reference = reference,
+    .orbit_format = orbit_format,
+    .orbit_budget = settings->orbit_budget,
+    .deep_deltas = settings->deep_deltas,
+    .nu = nu,
+    .sensitive = settings->mixed_precision ? arena_alloc(scratch, (size_t)view->image_width * view->image_height)
+                                           : NULL,
+    .certify = settings->certify,
+    .state = state,
+    .generation = generation,
+    .first_tile_done = ATOMIC_VAR_INIT(false),
+  };
+  plan_frame(pool, &job, state != NULL);
+  if (settings->strategy != STRATEGY_AUTO) {
+    job.strategy = settings->strategy;
+  }
+  if (reference != NULL) {
+    reference_stream_limit(&stream, job.max_iterations);
+  }
+  double plan_end = now_seconds();
+  long long iterated_before, iterated_after, rebased_before, rebased_after;
+  pool_counters(pool, &iterated_before, &rebased_before);
+  render_job_run(pool, &job, scratch);
+  pool_counters(pool, &iterated_after, &rebased_after);
+  // The margin reads on past the visible tiles, and the metrics report the frame's whole orbit.
+  if (reference != NULL && (keep != NULL || metrics != NULL)) {
+    reference_stream_finish(&stream);
+  } else if (reference != NULL) {
+    reference_stream_end(&stream);
+  }
+
+  if (metrics != NULL) {
+    *metrics = (FrameMetrics){
+      .precision = precision,
+      .strategy = job.strategy,
+      .max_iterations = job.max_iterations,
+      .reference_length = reference != NULL ? reference->length : 0,
+      // The workers count refined pixels as iterated again; here they count once.
+      .iterated = iterated_after - iterated_before - atomic_load(&job.refined),
+      .rebased = rebased_after - rebased_before,
+      .refined = atomic_load(&job.refined),
+      .certified = atomic_load(&job.certified),
+      .reference_time = reference != NULL ? stream.time : 0.0,
+      .plan_time = plan_end - start,
+      .iterate_time = now_seconds() - plan_end,
+      .busy_time = job.busy_time,
+    };
+  }
+  if (keep != NULL) {
+    *keep = reference;
+  } else if (reference != NULL) {
+    orbit_release(reference);
+  }
+  return job.max_iterations;
+}
+
+/* Renders the overscan margin around a view that is already in nu:
+ * `view` is widened by margin_x pixels on the left and right and by
+ * margin_y above and below, at the same scale, and nu is laid out for
+ * the wide view. The limit, strategy and reference orbit are the ones
+ * the visible part was rendered with, so the two agree where they meet;
+ * the wide view has the same center, so the orbit serves it too. Without
+ * one, the margin computes its own if it needs it. Returns false if
+ * `cancel` got set before it was done.
+ */
+bool render_margin(RenderPool* pool, const Settings* settings, const View* view, float* nu, Arena* scratch,
+                   int max_iterations, Strategy strategy, ReferenceOrbit* reference, int margin_x, int margin_y,
+                   atomic_bool* cancel) {
+  View wide = *view;
+  wide.image_width = view->image_width + 2 * margin_x;
+  wide.image_height = view->image_height + 2 * margin_y;
+  wide.width = view->scalex * wide.image_width;
+  wide.height = view->scaley * wide.image_height;
+  wide.real_min = view->real_min - view->scalex * margin_x;
+  wide.imag_min = view->imag_min - view->scaley * margin_y;
+
+  OrbitFormat orbit_format = reference != NULL ? reference->format
+                                               : settings->compact_orbit ? ORBIT_FLOAT : ORBIT_DOUBLE;
+  ReferenceOrbit* own = NULL;
+  ReferenceStream stream;
+  if (reference == NULL &&
+      tile_precision(&wide, 0, 0, wide.image_width, wide.image_height) == PRECISION_PERTURBATION) {
+    own = reference = arena_alloc(scratch, sizeof(*reference));
+    reference_stream(&stream, reference, orbit_format, view->exact_real, view->exact_imag, max_iterations,
+                     scratch, settings->orbit_budget);
+  }
+
+  RenderJob job = {
+    .view = wide,
+    .max_iterations = max_iterations,
+    .strategy = strategy,
+    .tile_size = settings->tile_size,
+    .tiles_x = (wide.image_width + settings->tile_size - 1) / settings->tile_size,
+    .split = settings->split,
+    .kernel = &kernels[settings->kernel],
+    .reference = reference,
+    .orbit_format = orbit_format,
+    .orbit_budget = settings->orbit_budget,
+    .deep_deltas = settings->deep_deltas,
+    .nu = nu,
+    .skip_x0 = margin_x,
+    .skip_y0 = margin_y,
+    .skip_x1 = margin_x + view->image_width,
+    .skip_y1 = margin_y + view->image_height,
+    .sensitive = settings->mixed_precision ? arena_alloc(scratch, (size_t)wide.image_width * wide.image_height)
+                                           : NULL,
+    .certify = settings->certify,
+    .cancel = cancel,
+    .first_tile_done = ATOMIC_VAR_INIT(false),
+  };
+  render_job_run(pool, &job, scratch);
+
+  if (own != NULL) {
+    reference_stream_end(&stream);
+    orbit_release(own);
+  }
+  return !atomic_load(cancel);
+}
+
+/* Returns the next free slot, blocking while the colorize stage still
+ * holds all of them. NULL means the pipeline is shutting down.
+ */
+FrameSlot* frame_queue_reserve(State* state) {
+  FrameQueue* queue = &state->frames;
+  FrameSlot* slot = NULL;
+  mtx_lock(&queue->lock);
+  while (queue->count == PIPELINE_DEPTH && !atomic_load(&state->quit)) {
+    cnd_wait(&queue->changed, &queue->lock);
+  }
+  if (!atomic_load(&state->quit)) {
+    slot = &queue->slots[(queue->head + queue->count) % PIPELINE_DEPTH];
+    queue->reserved = true;
+  }
+  mtx_unlock(&queue->lock);
+  return slot;
+}
+
+void frame_queue_push(FrameQueue* queue) {
+  mtx_lock(&queue->lock);
+  queue->reserved = false;
+  queue->count++;
+  cnd_broadcast(&queue->changed);
+  mtx_unlock(&queue->lock);
+}
+
+// Hands back a reserved slot without queueing it.
+void frame_queue_unreserve(FrameQueue* queue) {
+  mtx_lock(&queue->lock);
+  queue->reserved = false;
+  mtx_unlock(&queue->lock);
+}
+
+// Returns the oldest finished frame without releasing it, or NULL on quit.
+FrameSlot* frame_queue_front(State* state) {
+  FrameQueue* queue = &state->frames;
+  FrameSlot* slot = NULL;
+  mtx_lock(&queue->lock);
+  while (queue->count == 0 && !atomic_load(&state->quit)) {
+    cnd_wait(&queue->changed, &queue->lock);
+  }
+  if (queue->count > 0) {
+    slot = &queue->slots[queue->head];
+  }
+  mtx_unlock(&queue->lock);
+  return slot;
+}
+
+// MemoryShrink for the arenas of slots that hold no frame.
+size_t frame_queue_shrink(void* context, size_t wanted) {
+  FrameQueue* queue = context;
+  size_t freed = 0;
+  mtx_lock(&queue->lock);
+  int in_use = queue->count + queue->reserved;
+  for (int i = in_use; i < PIPELINE_DEPTH && freed < wanted; ++i) {
+    FrameSlot* slot = &queue->slots[(queue->head + i) % PIPELINE_DEPTH];
+    arena_reset(&slot->arena);
+    freed += arena_trim(&slot->arena);
+  }
+  mtx_unlock(&queue->lock);
+  return freed;
+}
+
+void frame_queue_pop(FrameQueue* queue) {
+  mtx_lock(&queue->lock);
+  queue->head = (queue->head + 1) % PIPELINE_DEPTH;
+  queue->count--;
+  cnd_broadcast(&queue->changed);
+  mtx_unlock(&queue->lock);
+}
+
+void history_init(History* history, const View* view, uint64_t generation, size_t budget) {
+  for (int i = 0; i < HISTORY_DEPTH; ++i) {
+    view_init(&history->entries[i].view, view->image_width, view->image_height);
+    history->entries[i].snapshot = NULL;
+    history->entries[i].snapshot_size = 0;
+  }
+  view_copy(&history->entries[0].view, view);
+  history->entries[0].generation = generation;
+  history->first = 0;
+  history->count = 1;
+  history->current = 0;
+  history->budget = budget;
+  history->used = 0;
+  history->pixels = (size_t)view->image_width * view->image_height;
+  history->planes = NULL;
+  history->deflated = NULL;
+  history->deflated_capacity = 0;
+  // Without a budget nothing is kept, and nothing needs staging.
+  if (budget > 0) {
+    history->planes = MemAlloc(history->pixels * sizeof(float));
+    history->deflated_capacity = compressBound(history->pixels * sizeof(float));
+    history->deflated = MemAlloc(history->deflated_capacity);
+    memory_charge(MEMORY_HISTORY, history->pixels * sizeof(float) + history->deflated_capacity);
+  }
+  mtx_init(&history->lock, mtx_plain);
+}
+
+static HistoryEntry* history_entry(History* history, int index) {
+  return &history->entries[(history->first + index) % HISTORY_DEPTH];
+}
+
+// Drops the snapshot of an entry, if it has one, and returns its size. With the lock held.
+static size_t history_drop(History* history, HistoryEntry* entry) {
+  size_t size = entry->snapshot_size;
+  if (entry->snapshot != NULL) {
+    free(entry->snapshot);
+    entry->snapshot = NULL;
+    entry->snapshot_size = 0;
+    history->used -= size;
+    memory_release(MEMORY_HISTORY, size);
+  }
+  return size;
+}
+
+/* Drops snapshots until `wanted` bytes are freed, furthest from the
+ * current entry first, and at the same distance the one undo would
+ * reach last. The current entry goes last, when its snapshot alone is
+ * more than can be kept. With the lock held; returns how many bytes were
+ * freed.
+ */
+static size_t history_evict(History* history, size_t wanted) {
+  size_t freed = 0;
+  int reach = history->current > history->count - 1 - history->current ? history->current
+                                                                          : history->count - 1 - history->current;
+  for (int distance = reach; distance > 0 && freed < wanted; --distance) {
+    if (history->current - distance >= 0) {
+      freed += history_drop(history, history_entry(history, history->current - distance));
+    }
+    if (freed < wanted && history->current + distance < history->count) {
+      freed += history_drop(history, history_entry(history, history->current + distance));
+    }
+  }
+  if (freed < wanted) {
+    freed += history_drop(history, history_entry(history, history->current));
+  }
+  return freed;
+}
+
+// MemoryShrink for the snapshots of the zoom history.
+size_t history_shrink(void* context, size_t wanted) {
+  History* history = context;
+  mtx_lock(&history->lock);
+  size_t freed = history_evict(history, wanted);
+  mtx_unlock(&history->lock);
+  return freed;
+}
+
+/* Makes `view`, which a zoom just went to, the current entry. Whatever
+ * could be redone is forgotten, and so is the oldest entry once the
+ * ring is full.
+ */
+void history_push(History* history, const View* view, uint64_t generation) {
+  mtx_lock(&history->lock);
+  for (int i = history->current + 1; i < history->count; ++i) {
+    history_drop(history, history_entry(history, i));
+  }
+  history->count = history->current + 1;
+  if (history->count == HISTORY_DEPTH) {
+    history_drop(history, history_entry(history, 0));
+    history->first = (history->first + 1) % HISTORY_DEPTH;
+    history->count--;
+  }
+  HistoryEntry* entry = history_entry(history, history->count++);
+  view_copy(&entry->view, view);
+  entry->generation = generation;
+  history->current = history->count - 1;
+  mtx_unlock(&history->lock);
+}
+
+// Moves the current entry along with a pan. Its snapshot is of the old view and goes.
+void history_pan(History* history, const View* view, uint64_t generation) {
+  mtx_lock(&history->lock);
+  HistoryEntry* entry = history_entry(history, history->current);
+  history_drop(history, entry);
+  view_copy(&entry->view, view);
+  entry->generation = generation;
+  mtx_unlock(&history->lock);
+}
+
+/* Goes `step` entries back (negative) or forward, and copies the view
+ * there into `view`. Returns false, and leaves `view` alone, when that
+ * is past either end.
+ */
+bool history_move(History* history, int step, View* view, uint64_t generation) {
+  mtx_lock(&history->lock);
+  int target = history->current + step;
+  bool moved = target >= 0 && target < history->count;
+  if (moved) {
+    history->current = target;
+    HistoryEntry* entry = history_entry(history, target);
+    entry->generation = generation;
+    view_copy(view, &entry->view);
+  }
+  mtx_unlock(&history->lock);
+  return moved;
+}
+
+/* Stages a frame for history_store() as byte planes: the lowest byte of
+ * every float, then the next, and so on. Neighbouring pixels mostly
+ * share their exponent and leading mantissa bits, so the planes deflate
+ * smaller than the floats do, and faster.
+ */
+void history_split(History* history, const float* nu) {
+  if (history->planes == NULL) {
+    return;
+  }
+  size_t count = history->pixels;
+  unsigned char* planes = history->planes;
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t bits;
+    memcpy(&bits, &nu[i], sizeof(bits));
+    planes[i] = (unsigned char)bits;
+    planes[count + i] = (unsigned char)(bits >> 8);
+    planes[2 * count + i] = (unsigned char)(bits >> 16);
+    planes[3 * count + i] = (unsigned char)(bits >> 24);
+  }
+}
+
+static void history_join(const History* history, float* nu) {
+  size_t count = history->pixels;
+  const unsigned char* planes = history->planes;
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t bits = (uint32_t)planes[i] | (uint32_t)planes[count + i] << 8 | (uint32_t)planes[2 * count + i] << 16 |
+                    (uint32_t)planes[3 * count + i] << 24;
+    memcpy(&nu[i], &bits, sizeof(bits));
+  }
+}
+
+/* Deflates the frame history_split() staged, rendered for `generation`,
+ * and keeps it with the entry made current at that generation if there
+ * still is one. Like the overscan margin it gives way to the next view:
+ * once `cancel` is set it gives up, and the entry is rendered again if
+ * undo or redo comes back to it.
+ */
+void history_store(History* history, uint64_t generation, int max_iterations, const FrameMetrics* metrics,
+                   atomic_bool* cancel) {
+  if (history->planes == NULL) {
+    return;
+  }
+  z_stream stream = { 0 };
+  if (deflateInit(&stream, HISTORY_LEVEL) != Z_OK) {
+    return;
+  }
+  size_t total = history->pixels * sizeof(float);
+  stream.next_out = history->deflated;
+  stream.avail_out = (uInt)history->deflated_capacity;
+  int status = Z_OK;
+  for (size_t offset = 0; offset < total && status == Z_OK && !atomic_load(cancel); offset += HISTORY_CHUNK) {
+    size_t chunk = total - offset < HISTORY_CHUNK ? total - offset : HISTORY_CHUNK;
+    stream.next_in = history->planes + offset;
+    stream.avail_in = (uInt)chunk;
+    status = deflate(&stream, offset + chunk == total ? Z_FINISH : Z_NO_FLUSH);
+  }
+  size_t size = stream.total_out;
+  deflateEnd(&stream);
+  if (status != Z_STREAM_END) {
+    return;
+  }
+  // Charged up front: a shrink it sets off takes the lock.
+  if (!memory_reserve(MEMORY_HISTORY, size)) {
+    return;
+  }
+  unsigned char* snapshot = malloc(size);
+  if (snapshot == NULL) {
+    memory_release(MEMORY_HISTORY, size);
+    return;
+  }
+  memcpy(snapshot, history->deflated, size);
+
+  bool kept = false;
+  mtx_lock(&history->lock);
+  for (int i = 0; i < history->count && !kept; ++i) {
+    HistoryEntry* entry = history_entry(history, i);
+    if (entry->generation == generation && entry->snapshot == NULL) {
+      entry->snapshot = snapshot;
+      entry->snapshot_size = size;
+      entry->max_iterations = max_iterations;
+      entry->metrics = *metrics;
+      history->used += size;
+      kept = true;
+    }
+  }
+  if (kept && history->used > history->budget) {
+    history_evict(history, history->used - history->budget);
+  }
+  mtx_unlock(&history->lock);
+  if (!kept) {
+    free(snapshot);
+    memory_release(MEMORY_HISTORY, size);
+  }
+}
+
+/* Fills nu from the snapshot of the entry made current at `generation`,
+ * along with the limit and metrics it was rendered with. Returns false
+ * when there is none, and the view has to be rendered.
+ */
+bool history_restore(History* history, uint64_t generation, float* nu, int* max_iterations, FrameMetrics* metrics) {
+  if (history->planes == NULL) {
+    return false;
+  }
+  // Copied out under the lock and inflated after, so evictions and pans need not wait for it.
+  size_t deflated = 0;
+  mtx_lock(&history->lock);
+  for (int i = 0; i < history->count; ++i) {
+    HistoryEntry* entry = history_entry(history, i);
+    if (entry->generation == generation) {
+      if (entry->snapshot != NULL) {
+        deflated = entry->snapshot_size;
+        memcpy(history->deflated, entry->snapshot, deflated);
+        *max_iterations = entry->max_iterations;
+        *metrics = entry->metrics;
+      }
+      break;
+    }
+  }
+  mtx_unlock(&history->lock);
+  uLongf size = history->pixels * sizeof(float);
+  bool restored = deflated > 0 && uncompress(history->planes, &size, history->deflated, deflated) == Z_OK &&
+                  size == history->pixels * sizeof(float);
+  if (restored) {
+    history_join(history, nu);
+  }
+  return restored;
+}
+
+void history_free(History* history) {
+  for (int i = 0; i < HISTORY_DEPTH; ++i) {
+    history_drop(history, &history->entries[i]);
+    view_clear(&history->entries[i].view);
+  }
+  if (history->planes != NULL) {
+    MemFree(history->planes);
+    MemFree(history->deflated);
+    memory_release(MEMORY_HISTORY, history->pixels * sizeof(float) + history->deflated_capacity);
+  }
+  mtx_destroy(&history->lock);
+}
+
+/* Copies `text` into `out` as the inside of a JSON string, cut short
+ * rather than split an escape when it does not fit.
+ */
+void json_escape(char* out, size_t size, const char* text) {
+  size_t length = 0;
+  for (const unsigned char* c = (const unsigned char*)text; *c != '\0'; ++c) {
+    char escaped[8];
+    if (*c == '"' || *c == '\\') {
+      snprintf(escaped, sizeof(escaped), "\\%c", *c);
+    } else if (*c < 0x20) {
+      snprintf(escaped, sizeof(escaped), "\\u%04x", *c);
+    } else {
+      snprintf(escaped, sizeof(escaped), "%c", *c);
+    }
+    size_t added = strlen(escaped);
+    if (length + added >= size) {
+      break;
+    }
+    memcpy(out + length, escaped, added);
+    length += added;
+  }
+  out[length] = '\0';
+}
+
+bool metrics_open(MetricsLog* log, const char* path) {
+  if ((log->file = fopen(path, "a")) == NULL) {
+    fprintf(stderr, "[METRICS] Cannot open %s\n", path);
+    return false;
+  }
+  // A record per line as it happens, so a session that dies midway still leaves a usable file.
+  setvbuf(log->file, NULL, _IOLBF, 0);
+  char host[HOST_NAME_MAX + 1];
+  if (gethostname(host, sizeof(host)) != 0) {
+    snprintf(host, sizeof(host), "unknown");
+  }
+  host[sizeof(host) - 1] = '\0';
+  json_escape(log->host, sizeof(log->host), host);
+  log->frames = 0;
+  return true;
+}
+
+/* Appends the record of a frame: what was rendered, how, and where the
+ * time went. The center is written out in full as a string, since deep
+ * views need more digits than a JSON number holds. Escape statistics are
+ * taken from nu here, so rendering does not pay for them without --metrics.
+ */
+void metrics_write(MetricsLog* log, const Settings* settings, const View* view, uint64_t generation,
+                   const float* nu, const FrameMetrics* metrics) {
+  long long pixels = (long long)view->image_width * view->image_height;
+  long long interior = 0;
+  double escape_sum = 0.0;
+  for (long long i = 0; i < pixels; ++i) {
+    if (nu[i] == -1.0f) {
+      interior++;
+    } else {
+      escape_sum += nu[i];
+    }
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  // Enough digits to tell neighbouring pixels apart.
+  int digits = (int)(view_precision_bits(view->width) * 0.30103) + 1;
+  double busy_share = metrics->iterate_time > 0.0
+                        ? metrics->busy_time / (metrics->iterate_time * settings->threads) : 0.0;
+
+  fprintf(log->file, "{\"time\":%.3f,\"host\":\"%s\",\"frame\":%llu,\"generation\":%llu,",
+          (double)ts.tv_sec + ts.tv_nsec * 1e-9, log->host, (unsigned long long)log->frames++,
+          (unsigned long long)generation);
+  gmp_fprintf(log->file, "\"center_real\":\"%.*Fe\",\"center_imag\":\"%.*Fe\",", digits, view->exact_real,
+              digits, view->exact_imag);
+  fprintf(log->file,
+          "\"view_width\":%.6Le,\"image_width\":%d,\"image_height\":%d,\"precision\":\"%s\","
+          "\"strategy\":\"%s\",\"kernel\":\"%s\",\"threads\":%d,\"tile_size\":%d,"
+          "\"max_iterations\":%d,\"reference_length\":%d,\"pixels\":%lld,\"iterated\":%lld,"
+          "\"filled\":%lld,\"rebased\":%lld,\"refined\":%lld,\"certified\":%lld,\"interior\":%lld,\"mean_escape\":%.3f,"
+          "\"reference_ms\":%.3f,\"plan_ms\":%.3f,\"iterate_ms\":%.3f,\"colorize_ms\":%.3f,"
+          "\"busy_share\":%.3f,\"restored\":%s}\n",
+          view->width, view->image_width, view->image_height, precision_names[metrics->precision],
+          strategy_names[metrics->strategy], kernels[settings->kernel].name, settings->threads,
+          settings->tile_size, metrics->max_iterations, metrics->reference_length, pixels, metrics->iterated,
+          pixels - metrics->iterated, metrics->rebased, metrics->refined, metrics->certified, interior,
+          pixels > interior ? escape_sum / (pixels - interior) : 0.0, metrics->reference_time * 1000.0,
+          metrics->plan_time * 1000.0, metrics->iterate_time * 1000.0, metrics->colorize_time * 1000.0,
+          busy_share, metrics->restored ? "true" : "false");
+}
+
+/* The renderer is a three stage pipeline:
+ *   iterate  - computes escape values of a view into a FrameSlot
+ *   colorize - turns a FrameSlot into pixels and swaps them to the front
+ *   upload   - main() copies the front buffer into the texture
+ * Each stage runs on its own thread, so while frame N is colorized and
+ * uploaded, frame N+1 is already being iterated.
+ */
+int iterate_stage(void* arg) {
+  State* state = arg;
+
+  View view;
+  view_init(&view, state->view.image_width, state->view.image_height);
+  // The visible part of a guard frame, laid out in the wide frame.
+  int wide_width = SCREEN_WIDTH + 2 * state->margin_x;
+  int wide_height = SCREEN_HEIGHT + 2 * state->margin_y;
+  size_t wide_size = (size_t)wide_width * wide_height * sizeof(float);
+  bool overscan = state->margin_x > 0 || state->margin_y > 0;
+  float* wide = NULL;
+  if (overscan) {
+    wide = MemAlloc(wide_size);
+    memory_charge(MEMORY_FRAMES, wide_size);
+  }
+  // What the visible frame and its margin need while they are iterated, the reference orbit above all.
+  Arena scratch;
+  arena_init(&scratch, "iterate", MEMORY_FRAMES, ARENA_CAPACITY);
+
+  while (true) {
+    mtx_lock(&state->view_lock);
+    while (!atomic_load(&state->dirty) && !atomic_load(&state->quit)) {
+      cnd_wait(&state->view_changed, &state->view_lock);
+    }
+    view_copy(&view, &state->view);
+    uint64_t generation = state->generation;
+    PanPosition position = state->position;
+    atomic_store(&state->dirty, false);
+    mtx_unlock(&state->view_lock);
+
+    FrameSlot* slot = frame_queue_reserve(state);
+    if (slot == NULL) {
+      break;
+    }
+
+    arena_reset(&slot->arena);
+    arena_reset(&scratch);
+    slot->generation = generation;
+    slot->nu = arena_alloc(&slot->arena, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(*slot->nu));
+    ReferenceOrbit* reference = NULL;
+
+    slot->guard = false;
+    // A view that undo or redo went back to may still have its frame.
+    double restore_start = now_seconds();
+    bool restored = history_restore(&state->history, generation, slot->nu, &slot->max_iterations, &slot->metrics);
+    if (restored) {
+      slot->metrics.restored = true;
+      slot->metrics.reference_time = 0.0;
+      slot->metrics.plan_time = 0.0;
+      slot->metrics.iterate_time = now_seconds() - restore_start;
+      slot->metrics.busy_time = 0.0;
+      progress_record(state, generation);
+    } else {
+      slot->max_iterations = render_view(state->pool, &state->settings, &view, slot->nu, &scratch, state,
+                                         generation, &slot->metrics, &reference);
+      history_split(&state->history, slot->nu);
+    }
+    view_copy(&slot->view, &view);
+    int max_iterations = slot->max_iterations;
+    Strategy strategy = slot->metrics.strategy;
+    bool guarded = overscan && !atomic_load(&state->dirty);
+    if (guarded) {
+      for (int y = 0; y < SCREEN_HEIGHT; ++y) {
+        memcpy(&wide[(size_t)(y + state->margin_y) * wide_width + state->margin_x], &slot->nu[y * SCREEN_WIDTH],
+               SCREEN_WIDTH * sizeof(*wide));
+      }
+    }
+    FrameMetrics metrics = slot->metrics;
+    atomic_store(&state->pushed_generation, generation);
+    frame_queue_push(&state->frames);
+    if (!restored) {
+      history_store(&state->history, generation, max_iterations, &metrics, &state->dirty);
+    }
+
+    /* The margin comes after the visible frame is on its way and gives
+     * way to the next view as soon as there is one. A guard frame shows
+     * a pan that stays within the margin right away, while the frame for
+     * the panned view is rendered.
+     */
+    FrameSlot* guard = guarded ? frame_queue_reserve(state) : NULL;
+    if (guard != NULL) {
+      arena_reset(&guard->arena);
+      if (render_margin(state->pool, &state->settings, &view, wide, &scratch, max_iterations, strategy, reference,
+                        state->margin_x, state->margin_y, &state->dirty)) {
+        guard->guard = true;
+        guard->generation = generation;
+        guard->position = position;
+        guard->max_iterations = max_iterations;
+        guard->nu = arena_alloc(&guard->arena, wide_size);
+        memcpy(guard->nu, wide, wide_size);
+        frame_queue_push(&state->frames);
+      } else {
+        frame_queue_unreserve(&state->frames);
+      }
+    }
+    if (reference != NULL) {
+      orbit_release(reference);
+    }
+    if (guarded && guard == NULL) {
+      break;
+    }
+  }
+  if (wide != NULL) {
+    MemFree(wide);
+    memory_release(MEMORY_FRAMES, wide_size);
+  }
+  arena_free(&scratch);
+  view_clear(&view);
+  printf("[ITERATE] Done\n");
+  return 0;
+}
+
+/* Counts a strip into the worker's histogram. Bin indices are computed
+ * 4 at a time and interior pixels go to the spare bin at the end, so the
+ * loop does not branch on the pixel. Each lane has its own copy of the
+ * counters: neighbouring pixels mostly share a bin, and incrementing one
+ * counter back to back would wait on the previous store every time.
+ */
+void colorize_count(Job* pool_job, int task, Worker* worker) {
+  typedef float vfloat __attribute__((vector_size(COLORIZE_LANES * sizeof(float))));
+  typedef int32_t vint __attribute__((vector_size(COLORIZE_LANES * sizeof(float))));
+
+  ColorizeJob* job = pool_job->context;
+  uint32_t* histogram = job->histograms + (size_t)worker->id * (job->bins + 1) * COLORIZE_LANES;
+  int last = job->bins - 1;
+  int start = task * COLORIZE_STRIP;
+  int end = start + COLORIZE_STRIP < job->count ? start + COLORIZE_STRIP : job->count;
+
+  int i = start;
+  for (; i + COLORIZE_LANES <= end; i += COLORIZE_LANES) {
+    vfloat value;
+    memcpy(&value, job->nu + i, sizeof(value));
+    vfloat shifted = value + 1.0f;
+    vint over = shifted >= (float)last;
+    vint bin = __builtin_convertvector(shifted, vint);
+    bin = (bin & ~over) | (last & over);
+    vint interior = value <= -1.0f;
+    bin = (bin & ~interior) | (job->bins & interior);
+    bin = bin * COLORIZE_LANES + (vint){ 0, 1, 2, 3 };
+    for (int lane = 0; lane < COLORIZE_LANES; ++lane) {
+      histogram[bin[lane]]++;
+    }
+  }
+  for (; i < end; ++i) {
+    float shifted = job->nu[i] + 1.0f;
+    int bin = shifted >= last ? last : (int)shifted;
+    histogram[(job->nu[i] > -1.0f ? bin : job->bins) * COLORIZE_LANES]++;
+  }
+}
+
+void colorize_merge(Job* pool_job, int task, Worker* worker) {
+  (void)worker;
+  ColorizeJob* job = pool_job->context;
+  int end = (task + 1) * COLORIZE_MERGE_BINS < job->bins ? (task + 1) * COLORIZE_MERGE_BINS : job->bins;
+  for (int bin = task * COLORIZE_MERGE_BINS; bin < end; ++bin) {
+    uint32_t sum = 0;
+    for (int w = 0; w < job->workers; ++w) {
+      const uint32_t* counters = job->histograms + ((size_t)w * (job->bins + 1) + bin) * COLORIZE_LANES;
+      for (int lane = 0; lane < COLORIZE_LANES; ++lane) {
+        sum += counters[lane];
+      }
+    }
+    job->counts[bin] = sum;
+  }
+}
+
+/* Maps a strip of escape values to their palette entries, 4 at a time.
+ * The index math runs on vectors; only the lookups are per pixel.
+ */
+void colorize_map(Job* pool_job, int task, Worker* worker) {
+  (void)worker;
+  typedef float vfloat __attribute__((vector_size(COLORIZE_LANES * sizeof(float))));
+  typedef int32_t vint __attribute__((vector_size(COLORIZE_LANES * sizeof(float))));
+
+  ColorizeJob* job = pool_job->context;
+  if (job->latest != NULL && atomic_load(job->latest) != job->generation) {
+    return;
+  }
+  const float* nu = job->nu;
+  Color* pixels = job->pixels;
+  const Color* palette = job->palette;
+  int last = job->palette_size - 1;
+  int start = task * COLORIZE_STRIP;
+  int end = start + COLORIZE_STRIP < job->count ? start + COLORIZE_STRIP : job->count;
+
+  int i = start;
+  for (; i + COLORIZE_LANES <= end; i += COLORIZE_LANES) {
+    vfloat value;
+    memcpy(&value, nu + i, sizeof(value));
+    vfloat scaled = (value + 1.0f) * (float)PALETTE_SUBSTEPS;
+    vint over = scaled >= (float)last;
+    vint index = __builtin_convertvector(scaled, vint) + 1;
+    index = (index & ~over) | (last & over);
+    // Interior pixels (nu = -1) get entry 0.
+    index &= value > -1.0f;
+    for (int lane = 0; lane < COLORIZE_LANES; ++lane) {
+      pixels[i + lane] = palette[index[lane]];
+    }
+  }
+  for (; i < end; ++i) {
+    int index = 0;
+    if (nu[i] > -1.0f) {
+      float scaled = (nu[i] + 1.0f) * PALETTE_SUBSTEPS;
+      index = scaled >= last ? last : (int)scaled + 1;
+    }
+    pixels[i] = palette[index];
+  }
+}
+
+/* Colors `count` escape values of a frame computed with up to
+ * max_iterations into `pixels`. Histogram coloring spreads the hues
+ * over the pixels rather than over the iterations: the hue at nu is
+ * the share of escaped pixels that escaped before nu, interpolated
+ * within a bin so that bands stay smooth. At deep zooms, where all
+ * pixels escape within a narrow range of iterations, that still uses
+ * the whole color wheel. Returns the palette, which lives in `scratch`,
+ * and its size in *palette_size unless that is NULL.
+ */
+const Color* colorize(RenderPool* pool, Coloring coloring, const float* nu, int count, int max_iterations,
+                      Color* pixels, Arena* scratch, int* palette_size) {
+  // nu + 1 tops out just above max_iterations + 2.
+  int bins = max_iterations + 3;
+  ColorizeJob job = {
+    .nu = nu,
+    .pixels = pixels,
+    .count = count,
+    .bins = bins,
+    .workers = pool->thread_count,
+    .palette_size = 1 + bins * PALETTE_SUBSTEPS,
+  };
+  job.palette = arena_alloc(scratch, job.palette_size * sizeof(*job.palette));
+  job.palette[0] = BLACK;
+  int strips = (count + COLORIZE_STRIP - 1) / COLORIZE_STRIP;
+
+  if (coloring == COLORING_HISTOGRAM) {
+    size_t histograms_size = (size_t)job.workers * (bins + 1) * COLORIZE_LANES * sizeof(*job.histograms);
+    job.histograms = arena_alloc(scratch, histograms_size);
+    job.counts = arena_alloc(scratch, bins * sizeof(*job.counts));
+    memset(job.histograms, 0, histograms_size);
+
+    Job count_job = { .run = colorize_count, .context = &job, .task_count = strips };
+    pool_run_urgent(pool, &count_job);
+    Job merge_job = {
+      .run = colorize_merge,
+      .context = &job,
+      .task_count = (bins + COLORIZE_MERGE_BINS - 1) / COLORIZE_MERGE_BINS,
+    };
+    pool_run_urgent(pool, &merge_job);
+
+    // cdf[b] is the share of escaped pixels below bin b.
+    float* cdf = arena_alloc(scratch, (bins + 1) * sizeof(*cdf));
+    uint64_t total = 0;
+    for (int b = 0; b < bins; ++b) {
+      total += job.counts[b];
+    }
+    uint64_t below = 0;
+    for (int b = 0; b <= bins; ++b) {
+      cdf[b] = total > 0 ? (float)below / total : 0.0f;
+      below += b < bins ? job.counts[b] : 0;
+    }
+    for (int k = 0; k < job.palette_size - 1; ++k) {
+      float position = (k + 0.5f) / PALETTE_SUBSTEPS;
+      int b = (int)position;
+      float share = cdf[b] + (position - b) * (cdf[b + 1] - cdf[b]);
+      job.palette[1 + k] = ColorFromHSV(share * 360.0f, 0.8f, 0.8f);
+    }
+  } else {
+    for (int k = 0; k < job.palette_size - 1; ++k) {
+      float value = (k + 0.5f) / PALETTE_SUBSTEPS - 1.0f;
+      job.palette[1 + k] = ColorFromHSV((int)(value * 10.0f), 0.8f, 0.8f);
+    }
+  }
+
+  Job map_job = { .run = colorize_map, .context = &job, .task_count = strips };
+  pool_run_urgent(pool, &map_job);
+  if (palette_size != NULL) {
+    *palette_size = job.palette_size;
+  }
+  return job.palette;
+}
+
+/* Colors a guard frame with the palette of the visible frame inside it,
+ * so the two match where they meet. It waits behind the work already on
+ * the pool and gives up as soon as the visible frame is not the latest
+ * any more; returns false if it did.
+ */
+bool colorize_guard(RenderPool* pool, const Color* palette, int palette_size, const float* nu, int count,
+                    Color* pixels, const _Atomic uint64_t* latest, uint64_t generation) {
+  ColorizeJob job = {
+    .nu = nu,
+    .pixels = pixels,
+    .count = count,
+    .palette = (Color*)palette,
+    .palette_size = palette_size,
+    .latest = latest,
+    .generation = generation,
+  };
+  Job map_job = { .run = colorize_map, .context = &job, .task_count = (count + COLORIZE_STRIP - 1) / COLORIZE_STRIP };
+  pool_run(pool, &map_job);
+  return atomic_load(latest) == generation;
+}
+
+int colorize_stage(void* arg) {
+  State* state = arg;
+  // The palette of the latest visible frame, for its guard frame.
+  Color* palette = NULL;
+  int palette_size = 0;
+  int palette_capacity = 0;
+  uint64_t palette_generation = 0;
+
+  FrameSlot* slot;
+  while ((slot = frame_queue_front(state)) != NULL) {
+    if (slot->guard) {
+      int pixels = (SCREEN_WIDTH + 2 * state->margin_x) * (SCREEN_HEIGHT + 2 * state->margin_y);
+      bool colored = palette_generation == slot->generation &&
+                     colorize_guard(state->pool, palette, palette_size, slot->nu, pixels, state->guard_back,
+                                    &state->pushed_generation, slot->generation);
+      PanPosition position = slot->position;
+      frame_queue_pop(&state->frames);
+      if (!colored) {
+        continue;
+      }
+
+      mtx_lock(&state->swap_lock);
+      while (atomic_load(&state->guard_ready) && !atomic_load(&state->quit)) {
+        cnd_wait(&state->uploaded, &state->swap_lock);
+      }
+      Color* tmp = state->guard_front;
+      state->guard_front = state->guard_back;
+      state->guard_back = tmp;
+      state->guard_position = position;
+      atomic_store(&state->guard_ready, true);
+      mtx_unlock(&state->swap_lock);
+      continue;
+    }
+
+    double start = now_seconds();
+    int size;
+    const Color* frame_palette = colorize(state->pool, state->coloring, slot->nu, SCREEN_WIDTH * SCREEN_HEIGHT,
+                                          slot->max_iterations, state->back, &slot->arena, &size);
+    uint64_t generation = slot->generation;
+    if (state->guard_back != NULL) {
+      if (size > palette_capacity) {
+        memory_release(MEMORY_FRAMES, palette_capacity * sizeof(*palette));
+        MemFree(palette);
+        palette = MemAlloc(size * sizeof(*palette));
+        palette_capacity = size;
+        memory_charge(MEMORY_FRAMES, palette_capacity * sizeof(*palette));
+      }
+      memcpy(palette, frame_palette, size * sizeof(*palette));
+      palette_size = size;
+      palette_generation = generation;
+    }
+    if (state->metrics != NULL) {
+      slot->metrics.colorize_time = now_seconds() - start;
+      metrics_write(state->metrics, &state->settings, &slot->view, generation, slot->nu, &slot->metrics);
+    }
+    view_copy(&state->back_view, &slot->view);
+    frame_queue_pop(&state->frames);
+
+    if (state->shm != NULL) {
+      shm_export_frame(state->shm, state->back, generation);
+    }
+
+    // Wait for main() to upload the previous frame before replacing it.
+    mtx_lock(&state->swap_lock);
+    while (atomic_load(&state->ready) && !atomic_load(&state->quit)) {
+      cnd_wait(&state->uploaded, &state->swap_lock);
+    }
+    Color* tmp = state->front;
+    state->front = state->back;
+    state->back = tmp;
+    View tmp_view = state->front_view;
+    state->front_view = state->back_view;
+    state->back_view = tmp_view;
+    state->front_generation = generation;
+    atomic_store(&state->ready, true);
+    mtx_unlock(&state->swap_lock);
+  }
+  if (palette != NULL) {
+    MemFree(palette);
+    memory_release(MEMORY_FRAMES, palette_capacity * sizeof(*palette));
+  }
+  printf("[COLORIZE] Done\n");
+  return 0;
+}
+
+/* Renders `frames` frames of `view` without a window, zooming in by
+ * ZOOM_FACTOR around the center from one to the next, and saves them as
+ * PREFIX00000.png, PREFIX00001.png, ... This thread only iterates and
+ * colors; encoding and writing the files is left to the output stage.
+ */
+int headless(const Settings* settings, Coloring coloring, View* view, const char* prefix, int frames,
+             MetricsLog* metrics) {
+  int width = view->image_width;
+  int height = view->image_height;
+  size_t pixels = (size_t)width * height;
+
+  RenderPool pool;
+  pool_init(&pool, settings->threads);
+
+  OutputQueue queue;
+  if (!output_open(&queue, &pool, width, height)) {
+    pool_destroy(&pool, false);
+    return 1;
+  }
+  thrd_t output_thr;
+  if (thrd_create(&output_thr, output_stage, &queue) != thrd_success) {
+    fprintf(stderr, "[OUTPUT] Cannot start the output thread\n");
+    output_free(&queue);
+    pool_destroy(&pool, false);
+    return 1;
+  }
+  Arena scratch;
+  // The frame, and with --mixed-precision a flag per pixel.
+  arena_init(&scratch, "headless", MEMORY_FRAMES, pixels * (sizeof(float) + 1) + ARENA_CAPACITY);
+
+  double start = now_seconds();
+  double iterate_time = 0.0;
+  double colorize_time = 0.0;
+  double wait_time = 0.0;
+  for (int frame = 0; frame < frames; ++frame) {
+    arena_reset(&scratch);
+    float* nu = arena_alloc(&scratch, pixels * sizeof(*nu));
+    double t0 = now_seconds();
+    FrameMetrics frame_metrics;
+    int max_iterations = render_view(&pool, settings, view, nu, &scratch, NULL, 0, &frame_metrics, NULL);
+    double t1 = now_seconds();
+    OutputBuffer* buffer = output_reserve(&queue);
+    double t2 = now_seconds();
+    colorize(&pool, coloring, nu, pixels, max_iterations, buffer->pixels, &scratch, NULL);
+    double t3 = now_seconds();
+    snprintf(buffer->path, sizeof(buffer->path), "%s%05d.png", prefix, frame);
+    output_push(&queue, buffer);
+    if (metrics != NULL) {
+      frame_metrics.colorize_time = t3 - t2;
+      metrics_write(metrics, settings, view, frame, nu, &frame_metrics);
+    }
+
+    iterate_time += t1 - t0;
+    wait_time += t2 - t1;
+    colorize_time += t3 - t2;
+    view_zoom(view, 0.0L, 0.0L, ZOOM_FACTOR);
+  }
+  double render_end = now_seconds();
+  bool written = output_close(&queue, output_thr);
+
+  printf("[HEADLESS] %d frames of %dx%d in %.2f s (%.2f s rendering): iterate %.1f ms, colorize %.1f ms, "
+         "waiting for output %.1f ms\n",
+         frames, width, height, now_seconds() - start, render_end - start, iterate_time * 1000.0,
+         colorize_time * 1000.0, wait_time * 1000.0);
+  pool_destroy(&pool, true);
+  arena_report(&scratch);
+  memory_report();
+  arena_free(&scratch);
+  return written ? 0 : 1;
+}
+
+int online_cpus(void) {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (int)count : 1;
+}
+
+bool kernel_available(int kernel) {
+  return kernels[kernel].available == NULL || kernels[kernel].available();
+}
+
+// The DeepDeltas called `name`, or -1 if there is none.
+int deep_deltas_find(const char* name) {
+  for (int deep = 0; deep < DEEP_DELTAS_COUNT; ++deep) {
+    if (strcmp(name, deep_deltas_names[deep]) == 0) {
+      return deep;
+    }
+  }
+  return -1;
+}
+
+// Index of the named kernel, or -1 if it is unknown or this CPU cannot run it.
+int kernel_find(const char* name) {
+  for (int i = 0; i < KERNEL_COUNT; ++i) {
+    if (strcmp(kernels[i].name, name) == 0 && kernel_available(i)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Untuned machines get the widest kernel they support.
+int kernel_default(void) {
+  int best = 0;
+  for (int i = 0; i < KERNEL_COUNT; ++i) {
+    if (kernel_available(i)) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+// Tuned settings are only valid on the CPU they were measured on.
+void cpu_model(char* model, size_t size) {
+  snprintf(model, size, "unknown");
+  FILE* file = fopen("/proc/cpuinfo", "r");
+  if (file == NULL) {
+    return;
+  }
+  char line[256];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    // "model name" on x86, "Hardware" or "CPU part" on ARM.
+    if (strncmp(line, "model name", 10) == 0 || strncmp(line, "Hardware", 8) == 0 ||
+        strncmp(line, "CPU part", 8) == 0) {
+      char* value = strchr(line, ':');
+      if (value != NULL) {
+        value += strspn(value + 1, " \t") + 1;
+        value[strcspn(value, "\n")] = '\0';
+        snprintf(model, size, "%s", value);
+        break;
+      }
+    }
+  }
+  fclose(file);
+}
+
+// $XDG_CONFIG_HOME/mzoom/tune.conf, or ~/.config/mzoom/tune.conf.
+bool tune_config_path(char* path, size_t size) {
+  const char* config = getenv("XDG_CONFIG_HOME");
+  const char* home = getenv("HOME");
+  if (config != NULL && config[0] != '\0') {
+    snprintf(path, size, "%s/mzoom/tune.conf", config);
+  } else if (home != NULL) {
+    snprintf(path, size, "%s/.config/mzoom/tune.conf", home);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/* The config file has one section per CPU model:
+ *   [Intel(R) Core(TM) i7-8550U CPU @ 1.80GHz]
+ *   kernel = scalar
+ *   tile_size = 64
+ *   threads = 8
+ */
+bool settings_load(Settings* settings, const char* cpu) {
+  char path[512];
+  if (!tune_config_path(path, sizeof(path))) {
+    return false;
+  }
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    return false;
+  }
+
+  bool found = false;
+  bool in_section = false;
+  char line[512];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+    if (line[0] == '[') {
+      char* end = strrchr(line, ']');
+      in_section = end != NULL && (size_t)(end - line - 1) == strlen(cpu) &&
+                   strncmp(line + 1, cpu, end - line - 1) == 0;
+      found |= in_section;
+      continue;
+    }
+    char key[32];
+    char value[64];
+    if (!in_section || sscanf(line, " %31[a-z_] = %63s", key, value) != 2) {
+      continue;
+    }
+    if (strcmp(key, "kernel") == 0 && kernel_find(value) >= 0) {
+      settings->kernel = kernel_find(value);
+    } else if (strcmp(key, "tile_size") == 0 && atoi(value) > 0) {
+      settings->tile_size = atoi(value);
+    } else if (strcmp(key, "threads") == 0 && atoi(value) > 0) {
+      settings->threads = atoi(value);
+    } else if (strcmp(key, "deep_deltas") == 0 && deep_deltas_find(value) >= 0) {
+      settings->deep_deltas = deep_deltas_find(value);
+    }
+  }
+  fclose(file);
+  return found;
+}
+
+// Replaces this CPU's section of the config file, keeping the others.
+bool settings_save(const Settings* settings, const char* cpu, const char* path) {
+  char dir[512];
+  snprintf(dir, sizeof(dir), "%s", path);
+  for (char* slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    mkdir(dir, 0755);
+    *slash = '/';
+  }
+
+  char tmp_path[520];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  FILE* out = fopen(tmp_path, "w");
+  if (out == NULL) {
+    return false;
+  }
+
+  FILE* in = fopen(path, "r");
+  if (in != NULL) {
+    bool skip = false;
+    char line[512];
+    while (fgets(line, sizeof(line), in) != NULL) {
+      if (line[0] == '[') {
+        size_t length = strlen(cpu);
+        skip = strncmp(line + 1, cpu, length) == 0 && line[length + 1] == ']';
+      }
+      if (!skip) {
+        fputs(line, out);
+      }
+    }
+    fclose(in);
+  } else {
+    fprintf(out, "# Written by mzoom --tune, one section per CPU model.\n");
+  }
+
+  fprintf(out, "[%s]\n", cpu);
+  fprintf(out, "kernel = %s\n", kernels[settings->kernel].name);
+  fprintf(out, "tile_size = %d\n", settings->tile_size);
+  fprintf(out, "threads = %d\n", settings->threads);
+  fprintf(out, "deep_deltas = %s\n", deep_deltas_names[settings->deep_deltas]);
+
+  bool ok = fclose(out) == 0 && rename(tmp_path, path) == 0;
+  if (!ok) {
+    remove(tmp_path);
+  }
+  return ok;
+}
+
+typedef struct {
+  const char* center_real;
+  const char* center_imag;
+  real_t width;
+} TuneView;
+
+static const TuneView tune_views[] = {
+  { "-0.5", "0.0", 3.0L },                             // mostly interior
+  { "-0.743643887037151", "0.131825904205330", 2e-4L },  // seahorse valley
+  { "-1.25066", "0.02012", 1.7e-4L },                  // dense filaments
+  { "-0.10109636384562", "0.95628651080914", 4e-16L },  // perturbation, mostly escaping
+  { "-0.743643887037151", "0.131825904205330", 0.02L },  // double, float first with --mixed-precision
+};
+
+// Spirals around the Misiurewicz point i, which have detail at any depth.
+static const TuneView tune_deep_views[] = {
+  { "0.0", "1.0", 1e-400L },
+};
+
+// Sum over `views` of the best of TUNE_REPEATS renders, in seconds.
+double tune_time(const Settings* settings, float* nu, const TuneView* views, size_t view_count) {
+  RenderPool pool;
+  pool_init(&pool, settings->threads);
+  Arena scratch;
+  arena_init(&scratch, "tune", MEMORY_FRAMES, ARENA_CAPACITY);
+  View view;
+  view_init(&view, TUNE_WIDTH, TUNE_HEIGHT);
+
+  double total = 0.0;
+  for (size_t v = 0; v < view_count; ++v) {
+    view_set_center(&view, views[v].center_real, views[v].center_imag, views[v].width);
+
+    double best = INFINITY;
+    for (int r = 0; r < TUNE_REPEATS; ++r) {
+      arena_reset(&scratch);
+      double start = now_seconds();
+      render_view(&pool, settings, &view, nu, &scratch, NULL, 0, NULL, NULL);
+      double elapsed = now_seconds() - start;
+      best = elapsed < best ? elapsed : best;
+    }
+    total += best;
+  }
+
+  view_clear(&view);
+  arena_free(&scratch);
+  pool_destroy(&pool, false);
+  return total;
+}
+
+// Best of TUNE_REPEATS renders of the benchmark views, in seconds.
+double tune_measure(const Settings* settings, float* nu) {
+  double total = tune_time(settings, nu, tune_views, sizeof(tune_views) / sizeof(tune_views[0]));
+  printf("[TUNE] kernel=%-8s tile_size=%-4d threads=%-3d %8.2f ms\n",
+         kernels[settings->kernel].name, settings->tile_size, settings->threads, total * 1000.0);
+  return total;
+}
+
+/* Micro-benchmarks the kernels, tile sizes and thread counts on this
+ * machine and stores the winners for its CPU model. The search is
+ * greedy, one knob at a time, to keep it short on big machines.
+ */
+int tune(void) {
+  char cpu[256];
+  char path[512];
+  cpu_model(cpu, sizeof(cpu));
+  if (!tune_config_path(path, sizeof(path))) {
+    fprintf(stderr, "[TUNE] Neither XDG_CONFIG_HOME nor HOME is set\n");
+    return 1;
+  }
+  printf("[TUNE] CPU: %s\n", cpu);
+
+  float* nu = MemAlloc(TUNE_WIDTH * TUNE_HEIGHT * sizeof(*nu));
+  int cpus = online_cpus();
+  Settings best = {
+    .kernel = kernel_default(),
+    .tile_size = DEFAULT_TILE_SIZE,
+    .threads = cpus,
+    .orbit_budget = DEFAULT_ORBIT_BUDGET,
+  };
+  double best_time = INFINITY;
+
+  for (int kernel = 0; kernel < KERNEL_COUNT; ++kernel) {
+    if (!kernel_available(kernel)) {
+      continue;
+    }
+    Settings candidate = best;
+    candidate.kernel = kernel;
+    double time = tune_measure(&candidate, nu);
+    if (time < best_time) {
+      best = candidate;
+      best_time = time;
+    }
+  }
+
+  static const int tile_sizes[] = { 16, 32, 64, 128 };
+  for (size_t i = 0; i < sizeof(tile_sizes) / sizeof(tile_sizes[0]); ++i) {
+    if (tile_sizes[i] == best.tile_size) {
+      continue;
+    }
+    Settings candidate = best;
+    candidate.tile_size = tile_sizes[i];
+    double time = tune_measure(&candidate, nu);
+    if (time < best_time) {
+      best = candidate;
+      best_time = time;
+    }
+  }
+
+  for (int threads = 1; threads < 2 * cpus; threads *= 2) {
+    if (threads == best.threads) {
+      continue;
+    }
+    Settings candidate = best;
+    candidate.threads = threads;
+    double time = tune_measure(&candidate, nu);
+    if (time < best_time) {
+      best = candidate;
+      best_time = time;
+    }
+  }
+
+  // Deep deltas only matter past 1e-270, they are timed on their own views.
+  double best_deep_time = INFINITY;
+  for (int deep = 0; deep < DEEP_DELTAS_COUNT; ++deep) {
+    Settings candidate = best;
+    candidate.deep_deltas = deep;
+    double time = tune_time(&candidate, nu, tune_deep_views, sizeof(tune_deep_views) / sizeof(tune_deep_views[0]));
+    printf("[TUNE] deep_deltas=%-8s %8.2f ms\n", deep_deltas_names[deep], time * 1000.0);
+    if (time < best_deep_time) {
+      best.deep_deltas = deep;
+      best_deep_time = time;
+    }
+  }
+  MemFree(nu);
+
+  printf("[TUNE] Best: kernel=%s tile_size=%d threads=%d deep_deltas=%s\n",
+         kernels[best.kernel].name, best.tile_size, best.threads, deep_deltas_names[best.deep_deltas]);
+  if (!settings_save(&best, cpu, path)) {
+    fprintf(stderr, "[TUNE] Cannot write %s\n", path);
+    return 1;
+  }
+  printf("[TUNE] Wrote %s\n", path);
+  return 0;
+}
+
+/* Renders the benchmark views with each strategy that skips pixels and
+ * compares against brute force. A pixel is off band when its integer
+ * iteration count, or being interior, differs from brute force; the
+ * smooth value of a filled pixel is allowed to differ. With --certify or
+ * --mixed-precision, the strategies use them and brute force is checked
+ * as well, against itself without them. The strategies whose tasks give
+ * work away are also rendered with splitting forced off and on, and
+ * have to come out the same all three ways.
+ */
+int conformance(const Settings* settings) {
+  // Share of pixels a strategy may get into another band. Guessing only
+  // looks one row up and down, and misses more on the filaments: up to
+  // 0.84% of them on view 2.
+  static const double tolerance[STRATEGY_COUNT] = {
+    [STRATEGY_BRUTE] = 0.001,
+    [STRATEGY_MARIANI_SILVER] = 0.001,
+    [STRATEGY_GUESSING] = 0.01,
+    [STRATEGY_BOUNDARY] = 0.001,
+  };
+  RenderPool pool;
+  pool_init(&pool, settings->threads);
+  Arena scratch;
+  arena_init(&scratch, "conformance", MEMORY_FRAMES, ARENA_CAPACITY);
+  View view;
+  view_init(&view, TUNE_WIDTH, TUNE_HEIGHT);
+  int pixels = TUNE_WIDTH * TUNE_HEIGHT;
+  float* expected = MemAlloc(pixels * sizeof(*expected));
+  float* nu = MemAlloc(pixels * sizeof(*nu));
+  float* unsplit = MemAlloc(pixels * sizeof(*unsplit));
+  float* split = MemAlloc(pixels * sizeof(*split));
+
+  bool ok = true;
+  for (size_t v = 0; v < sizeof(tune_views) / sizeof(tune_views[0]); ++v) {
+    view_set_center(&view, tune_views[v].center_real, tune_views[v].center_imag, tune_views[v].width);
+    Settings brute = *settings;
+    brute.strategy = STRATEGY_BRUTE;
+    brute.certify = false;
+    brute.mixed_precision = false;
+    arena_reset(&scratch);
+    double start = now_seconds();
+    render_view(&pool, &brute, &view, expected, &scratch, NULL, 0, NULL, NULL);
+    printf("[CONFORMANCE] view %zu %-14s %8.2f ms\n", v, strategy_names[STRATEGY_BRUTE],
+           (now_seconds() - start) * 1000.0);
+
+    int first = settings->certify || settings->mixed_precision ? STRATEGY_BRUTE : STRATEGY_MARIANI_SILVER;
+    for (int strategy = first; strategy < STRATEGY_COUNT; ++strategy) {
+      Settings candidate = *settings;
+      candidate.strategy = strategy;
+      arena_reset(&scratch);
+      start = now_seconds();
+      FrameMetrics metrics;
+      render_view(&pool, &candidate, &view, nu, &scratch, NULL, 0, &metrics, NULL);
+      double elapsed = now_seconds() - start;
+
+      int off_band = 0;
+      int differing = 0;
+      float max_error = 0.0f;
+      for (int i = 0; i < pixels; ++i) {
+        off_band += !nu_same_band(expected[i], nu[i]);
+        differing += expected[i] != nu[i];
+        if (expected[i] != -1.0f && nu[i] != -1.0f) {
+          max_error = fmaxf(max_error, fabsf(expected[i] - nu[i]));
+        }
+      }
+      double share = (double)off_band / pixels;
+      printf("[CONFORMANCE] view %zu %-14s %8.2f ms  off band %7d (%.4f%%)  differing %7d  max error %.3g\n", v,
+             strategy_names[strategy], elapsed * 1000.0, off_band, share * 100.0, differing, max_error);
+      ok &= share <= tolerance[strategy];
+      // Every pixel is either iterated or filled, so neither count may pass the other.
+      if (metrics.iterated < 0 || metrics.iterated > pixels) {
+        printf("[CONFORMANCE] view %zu %-14s counts %lld iterated pixels out of %d\n", v, strategy_names[strategy],
+               metrics.iterated, pixels);
+        ok = false;
+      }
+
+      if (strategy == STRATEGY_BOUNDARY) {
+        continue;
+      }
+      candidate.split = SPLIT_NEVER;
+      arena_reset(&scratch);
+      render_view(&pool, &candidate, &view, unsplit, &scratch, NULL, 0, NULL, NULL);
+      candidate.split = SPLIT_ALWAYS;
+      arena_reset(&scratch);
+      render_view(&pool, &candidate, &view, split, &scratch, NULL, 0, NULL, NULL);
+      int split_differing = 0;
+      for (int i = 0; i < pixels; ++i) {
+        split_differing += unsplit[i] != nu[i] || unsplit[i] != split[i];
+      }
+      if (split_differing > 0) {
+        printf("[CONFORMANCE] view %zu %-14s %d pixels depend on how tiles are split\n", v, strategy_names[strategy],
+               split_differing);
+        ok = false;
+      }
+    }
+  }
+
+  MemFree(split);
+  MemFree(unsplit);
+  MemFree(nu);
+  MemFree(expected);
+  view_clear(&view);
+  arena_free(&scratch);
+  pool_destroy(&pool, false);
+  printf("[CONFORMANCE] %s\n", ok ? "passed" : "failed");
+  return ok ? 0 : 1;
+}
+
+// Applies an input event to the view and returns the generation that renders it.
+uint64_t apply_input(State* state, const InputEvent* event) {
+  mtx_lock(&state->view_lock);
+  View* view = &state->view;
+  // Offset of the point under the cursor from the center.
+  real_t mouse_real = view->scalex * (event->x + 0.5L) - view->width * 0.5L;
+  real_t mouse_imag = view->scaley * ((real_t)(view->image_height - event->y - 1) + 0.5L) - view->height * 0.5L;
+
+  switch (event->kind) {
+  case INPUT_CLICK:
+    view_zoom(view, mouse_real, mouse_imag, ZOOM_FACTOR);
+    break;
+  case INPUT_SCROLL: {
+    // Zoom around the cursor, so the point under it stays put.
+    real_t factor = powl(ZOOM_FACTOR, event->amount);
+    view_zoom(view, mouse_real * (1.0L - factor), mouse_imag * (1.0L - factor), factor);
+    break;
+  }
+  case INPUT_PAN: {
+    // Whole pixels, so the new view is the old grid shifted.
+    long long dx = llroundf(event->x);
+    long long dy = llroundf(event->y);
+    view_zoom(view, view->scalex * dx, -view->scaley * dy, 1.0L);
+    state->position.x += dx;
+    state->position.y += dy;
+    break;
+  }
+  case INPUT_UNDO:
+  case INPUT_REDO:
+    if (!history_move(&state->history, event->kind == INPUT_UNDO ? -1 : 1, view, state->generation + 1)) {
+      // Nothing to go back or forward to.
+      mtx_unlock(&state->view_lock);
+      return state->generation;
+    }
+    break;
+  case INPUT_COUNT:
+    break;
+  }
+  if (event->kind != INPUT_PAN) {
+    state->position.zooms++;
+  }
+
+  uint64_t generation = ++state->generation;
+  if (event->kind == INPUT_CLICK || event->kind == INPUT_SCROLL) {
+    history_push(&state->history, view, generation);
+  } else if (event->kind == INPUT_PAN) {
+    history_pan(&state->history, view, generation);
+  }
+  atomic_store(&state->dirty, true);
+  cnd_signal(&state->view_changed);
+  mtx_unlock(&state->view_lock);
+  return generation;
+}
+
+/* Script format, one event per line, times in milliseconds since the
+ * first frame is on screen:
+ *   <ms> click <x> <y>
+ *   <ms> scroll <x> <y> <steps>
+ *   <ms> pan <dx> <dy>
+ *   <ms> undo
+ *   <ms> redo
+ * Lines starting with '#' are comments. --record writes the same format.
+ */
+bool replay_load(Replay* replay, const char* path) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "[REPLAY] Cannot open %s\n", path);
+    return false;
+  }
+
+  int capacity = 0;
+  char line[256];
+  int line_number = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    line_number++;
+    char kind[16];
+    double ms;
+    InputEvent event = { .amount = 1.0f };
+    int fields = sscanf(line, "%lf %15s %f %f %f", &ms, kind, &event.x, &event.y, &event.amount);
+    if (fields <= 0 || line[strspn(line, " \t")] == '#') {
+      continue;
+    }
+
+    event.time = ms / 1000.0;
+    if (fields >= 4 && strcmp(kind, "click") == 0) {
+      event.kind = INPUT_CLICK;
+    } else if (fields >= 4 && strcmp(kind, "scroll") == 0) {
+      event.kind = INPUT_SCROLL;
+    } else if (fields >= 4 && strcmp(kind, "pan") == 0) {
+      event.kind = INPUT_PAN;
+    } else if (fields >= 2 && strcmp(kind, "undo") == 0) {
+      event.kind = INPUT_UNDO;
+    } else if (fields >= 2 && strcmp(kind, "redo") == 0) {
+      event.kind = INPUT_REDO;
+    } else {
+      fprintf(stderr, "[REPLAY] %s:%d: cannot parse event\n", path, line_number);
+      fclose(file);
+      return false;
+    }
+    if (replay->count > 0 && event.time < replay->events[replay->count - 1].time) {
+      fprintf(stderr, "[REPLAY] %s:%d: events must be in time order\n", path, line_number);
+      fclose(file);
+      return false;
+    }
+
+    if (replay->count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      replay->events = realloc(replay->events, capacity * sizeof(*replay->events));
+    }
+    replay->events[replay->count++] = event;
+  }
+  fclose(file);
+
+  replay->samples = calloc(replay->count ? replay->count : 1, sizeof(*replay->samples));
+  return true;
+}
+
+int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of an already sorted array.
+double percentile(const double* sorted, int count, double p) {
+  int rank = (int)ceil(p / 100.0 * count);
+  if (rank < 1) {
+    rank = 1;
+  }
+  return sorted[rank - 1];
+}
+
+void replay_report(const Replay* replay) {
+  double* first = malloc(replay->count * sizeof(*first));
+  double* screen = malloc(replay->count * sizeof(*screen));
+  for (int i = 0; i < replay->count; ++i) {
+    first[i] = (replay->samples[i].first_pixels - replay->samples[i].input) * 1000.0;
+    screen[i] = (replay->samples[i].on_screen - replay->samples[i].input) * 1000.0;
+  }
+  qsort(first, replay->count, sizeof(*first), compare_doubles);
+  qsort(screen, replay->count, sizeof(*screen), compare_doubles);
+
+  printf("[REPLAY] %d inputs\n", replay->count);
+  printf("[REPLAY] input -> first pixels:    p50 %8.2f ms  p99 %8.2f ms  max %8.2f ms\n",
+         percentile(first, replay->count, 50.0), percentile(first, replay->count, 99.0), first[replay->count - 1]);
+  printf("[REPLAY] input -> frame on screen: p50 %8.2f ms  p99 %8.2f ms  max %8.2f ms\n",
+         percentile(screen, replay->count, 50.0), percentile(screen, replay->count, 99.0), screen[replay->count - 1]);
+  free(first);
+  free(screen);
+}
+
+int main(int argc, char** argv) {
+  const char* replay_path = NULL;
+  const char* record_path = NULL;
+  const char* shm_name = NULL;
+  const char* headless_prefix = NULL;
+  const char* metrics_path = NULL;
+  bool conformance_run = false;
+  int image_width = SCREEN_WIDTH;
+  int image_height = SCREEN_HEIGHT;
+  int frames = 1;
+  const char* center_real = NULL;
+  const char* center_imag = NULL;
+  real_t width = 0.0L;
+  int threads = 0;
+  int tile_size = 0;
+  bool compact_orbit = false;
+  bool mixed_precision = false;
+  bool certify = false;
+  double orbit_budget_mb = -1.0;
+  double memory_budget_mb = 0.0;
+  double history_budget_mb = DEFAULT_HISTORY_BUDGET / 1048576.0;
+  double overscan = 0.0;
+  memory_init();
+  Coloring coloring = COLORING_HISTOGRAM;
+  int strategy = STRATEGY_AUTO;
+  int deep_deltas = -1;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--tune") == 0) {
+      return tune();
+    } else if (strcmp(argv[i], "--conformance") == 0) {
+      conformance_run = true;
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--tile-size") == 0 && i + 1 < argc) {
+      tile_size = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--center") == 0 && i + 2 < argc) {
+      center_real = argv[++i];
+      center_imag = argv[++i];
+    } else if (strcmp(argv[i], "--width") == 0 && i + 1 < argc) {
+      width = strtold(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--compact-orbit") == 0) {
+      compact_orbit = true;
+    } else if (strcmp(argv[i], "--mixed-precision") == 0) {
+      mixed_precision = true;
+    } else if (strcmp(argv[i], "--certify") == 0) {
+      certify = true;
+    } else if (strcmp(argv[i], "--orbit-budget") == 0 && i + 1 < argc) {
+      orbit_budget_mb = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--mem-budget") == 0 && i + 1 < argc) {
+      memory_budget_mb = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--history-budget") == 0 && i + 1 < argc) {
+      history_budget_mb = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--coloring") == 0 && i + 1 < argc && strcmp(argv[i + 1], "histogram") == 0) {
+      coloring = COLORING_HISTOGRAM;
+      i++;
+    } else if (strcmp(argv[i], "--coloring") == 0 && i + 1 < argc && strcmp(argv[i + 1], "cycle") == 0) {
+      coloring = COLORING_CYCLE;
+      i++;
+    } else if (strcmp(argv[i], "--strategy") == 0 && i + 1 < argc &&
+               (strategy = strategy_from_name(argv[i + 1])) >= 0) {
+      i++;
+    } else if (strcmp(argv[i], "--deep-deltas") == 0 && i + 1 < argc &&
+               (deep_deltas = deep_deltas_find(argv[i + 1])) >= 0) {
+      i++;
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      replay_path = argv[++i];
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      record_path = argv[++i];
+    } else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+      shm_name = argv[++i];
+    } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+      metrics_path = argv[++i];
+    } else if (strcmp(argv[i], "--overscan") == 0 && i + 1 < argc && (overscan = atof(argv[i + 1])) >= 0.0 &&
+               overscan <= 1.0) {
+      i++;
+    } else if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc) {
+      headless_prefix = argv[++i];
+    } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc &&
+               sscanf(argv[i + 1], "%dx%d", &image_width, &image_height) == 2 && image_width > 0 &&
+               image_height > 0) {
+      i++;
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frames = atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "usage: %s [--tune] [--conformance] [--threads N] [--tile-size N] [--center RE IM] [--width W]\n"
+                      "       [--compact-orbit] [--orbit-budget MB] [--mem-budget MB] [--history-budget MB]\n"
+                      "       [--mixed-precision] [--certify] [--coloring histogram|cycle]\n"
+                      "       [--strategy auto|brute|mariani-silver|guessing|boundary]\n"
+                      "       [--deep-deltas rescaled|floatexp] [--replay FILE] [--record FILE] [--shm NAME] [--metrics FILE]\n"
+                      "       [--overscan FRACTION] [--headless PREFIX] [--size WxH] [--frames N]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  Settings settings = {
+    .kernel = kernel_default(),
+    .tile_size = DEFAULT_TILE_SIZE,
+    .threads = online_cpus(),
+    .orbit_budget = DEFAULT_ORBIT_BUDGET,
+  };
+  char cpu[256];
+  cpu_model(cpu, sizeof(cpu));
+  if (settings_load(&settings, cpu)) {
+    printf("[TUNE] Using tuned settings: kernel=%s tile_size=%d threads=%d\n",
+           kernels[settings.kernel].name, settings.tile_size, settings.threads);
+  }
+  if (threads > 0) {
+    settings.threads = threads;
+  }
+  if (tile_size > 0) {
+    settings.tile_size = tile_size;
+  }
+  settings.compact_orbit = compact_orbit;
+  settings.strategy = strategy;
+  settings.mixed_precision = mixed_precision;
+  settings.certify = certify;
+  if (deep_deltas >= 0) {
+    settings.deep_deltas = deep_deltas;
+  }
+  if (orbit_budget_mb >= 0.0) {
+    settings.orbit_budget = orbit_budget_mb * (1 << 20);
+  }
+  memory.budget = memory_budget_mb * (1 << 20);
+
+  if (conformance_run) {
+    return conformance(&settings);
+  }
+  MetricsLog metrics;
+  if (metrics_path != NULL && !metrics_open(&metrics, metrics_path)) {
+    return 1;
+  }
+  if (headless_prefix != NULL) {
+    View view;
+    view_init(&view, image_width, image_height);
+    if (center_real != NULL || width > 0.0L) {
+      if (!view_set_center(&view, center_real ? center_real : "-0.5", center_imag ? center_imag : "0",
+                           width > 0.0L ? width : 3.0L)) {
+        fprintf(stderr, "Cannot parse --center %s %s\n", center_real, center_imag);
+        return 1;
+      }
+    }
+    int status = headless(&settings, coloring, &view, headless_prefix, frames,
+                          metrics_path != NULL ? &metrics : NULL);
+    view_clear(&view);
+    if (metrics_path != NULL) {
+      fclose(metrics.file);
+    }
+    return status;
+  }
+
+  Replay replay = { 0 };
+  if (replay_path != NULL && !replay_load(&replay, replay_path)) {
+    return 1;
+  }
+  bool replaying = replay.count > 0;
+
+  FILE* record = NULL;
+  if (record_path != NULL && (record = fopen(record_path, "w")) == NULL) {
+    fprintf(stderr, "[RECORD] Cannot open %s\n", record_path);
+    return 1;
+  }
+
+  ShmExport shm;
+  if (shm_name != NULL && !shm_export_open(&shm, shm_name)) {
+    return 1;
+  }
+
+  InitWindow(SCREEN_WIDTH, SCREEN_HEIGHT, "MZOOM");
+
+  // While something is moving we present at the display rate, otherwise
+  // the main loop sleeps until the next input event.
+  int refresh_rate = GetMonitorRefreshRate(GetCurrentMonitor());
+  if (refresh_rate <= 0) {
+    refresh_rate = 60;
+  }
+  // Replays time their own events and should not wait on frame pacing.
+  SetTargetFPS(replaying ? 0 : refresh_rate);
+
+  Texture2D texture = LoadTextureFromImage(GenImageColor(SCREEN_WIDTH, SCREEN_HEIGHT, BLACK));
+  int margin_x = (int)lround(overscan * SCREEN_WIDTH);
+  int margin_y = (int)lround(overscan * SCREEN_HEIGHT);
+  int guard_width = SCREEN_WIDTH + 2 * margin_x;
+  int guard_height = SCREEN_HEIGHT + 2 * margin_y;
+  size_t guard_size = overscan > 0.0 ? (size_t)guard_width * guard_height * sizeof(Color) : 0;
+  Texture2D guard_texture = { 0 };
+  if (guard_size > 0) {
+    guard_texture = LoadTextureFromImage(GenImageColor(guard_width, guard_height, BLACK));
+  }
+
+  State state = {
+    .front = MemAlloc(TEXTURE_BUFSIZE),
+    .back =  MemAlloc(TEXTURE_BUFSIZE),
+    .generation = 1,
+    .dirty = ATOMIC_VAR_INIT(true),
+    .ready = ATOMIC_VAR_INIT(false),
+    .quit = ATOMIC_VAR_INIT(false),
+    .guard_front = guard_size > 0 ? MemAlloc(guard_size) : NULL,
+    .guard_back = guard_size > 0 ? MemAlloc(guard_size) : NULL,
+    .guard_ready = ATOMIC_VAR_INIT(false),
+    .margin_x = margin_x,
+    .margin_y = margin_y,
+    .shm = shm_name != NULL ? &shm : NULL,
+    .metrics = metrics_path != NULL ? &metrics : NULL,
+    .settings = settings,
+    .coloring = coloring,
+  };
+  memory_charge(MEMORY_TEXTURES, 2 * TEXTURE_BUFSIZE + 2 * guard_size);
+  view_init(&state.view, SCREEN_WIDTH, SCREEN_HEIGHT);
+  if (center_real != NULL || width > 0.0L) {
+    if (!view_set_center(&state.view, center_real ? center_real : "-0.5", center_imag ? center_imag : "0",
+                         width > 0.0L ? width : 3.0L)) {
+      fprintf(stderr, "Cannot parse --center %s %s\n", center_real, center_imag);
+      return 1;
+    }
+  }
+  view_init(&state.front_view, SCREEN_WIDTH, SCREEN_HEIGHT);
+  view_init(&state.back_view, SCREEN_WIDTH, SCREEN_HEIGHT);
+  history_init(&state.history, &state.view, state.generation, history_budget_mb > 0.0 ? history_budget_mb * (1 << 20) : 0);
+  memory_register(history_shrink, &state.history);
+
+  RenderPool pool;
+  pool_init(&pool, settings.threads);
+  state.pool = &pool;
+
+  for (int i = 0; i < PIPELINE_DEPTH; ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "frame%d", i);
+    arena_init(&state.frames.slots[i].arena, name, MEMORY_FRAMES, ARENA_CAPACITY);
+    view_init(&state.frames.slots[i].view, SCREEN_WIDTH, SCREEN_HEIGHT);
+  }
+
+  // TODO: check for failure?
+  mtx_init(&state.frames.lock, mtx_plain);
+  cnd_init(&state.frames.changed);
+  memory_register(frame_queue_shrink, &state.frames);
+  mtx_init(&state.view_lock, mtx_plain);
+  cnd_init(&state.view_changed);
+  mtx_init(&state.swap_lock, mtx_plain);
+  cnd_init(&state.uploaded);
+
+  thrd_t iterate_thr, colorize_thr;
+  thrd_create(&iterate_thr, iterate_stage, &state);
+  thrd_create(&colorize_thr, colorize_stage, &state);
+
+  uint64_t requested_generation = state.generation;
+  uint64_t presented_generation = 0;
+  double session_start = 0.0;
+  bool redraw = true;
+  // Where the uploaded guard frame was rendered, if there is one.
+  bool guard_shown = false;
+  PanPosition guard_position = { 0 };
+  // Right-button drags not yet applied, below a pixel.
+  Vector2 drag = { 0 };
+  // Where the uploaded frame was rendered, and the latest undo or redo.
+  View presented_view;
+  view_init(&presented_view, SCREEN_WIDTH, SCREEN_HEIGHT);
+  uint64_t history_generation = 0;
+
+  while (!WindowShouldClose()) {
+    double now = now_seconds();
+
+    InputEvent events[16];
+    int event_count = 0;
+    if (replaying) {
+      // Everything that came due since the last iteration, bursts included.
+      while (session_start > 0.0 && replay.next + event_count < replay.count && event_count < 16 &&
+             now - session_start >= replay.events[replay.next + event_count].time) {
+        events[event_count] = replay.events[replay.next + event_count];
+        event_count++;
+      }
+    } else {
+      Vector2 mouse_pos = GetMousePosition();
+      if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
+        events[event_count++] = (InputEvent){ .kind = INPUT_CLICK, .x = mouse_pos.x, .y = mouse_pos.y };
+      }
+      float wheel = GetMouseWheelMove();
+      if (wheel != 0.0f) {
+        events[event_count++] = (InputEvent){ .kind = INPUT_SCROLL, .x = mouse_pos.x, .y = mouse_pos.y, .amount = wheel };
+      }
+      // Dragging moves the picture with the cursor, the arrow keys move the view.
+      if (IsMouseButtonDown(MOUSE_BUTTON_RIGHT)) {
+        Vector2 delta = GetMouseDelta();
+        drag.x -= delta.x;
+        drag.y -= delta.y;
+      }
+      InputEvent pan = { .kind = INPUT_PAN, .x = truncf(drag.x), .y = truncf(drag.y) };
+      drag.x -= pan.x;
+      drag.y -= pan.y;
+      pan.x += PAN_STEP * (IsKeyPressed(KEY_RIGHT) - IsKeyPressed(KEY_LEFT));
+      pan.y += PAN_STEP * (IsKeyPressed(KEY_DOWN) - IsKeyPressed(KEY_UP));
+      if (pan.x != 0.0f || pan.y != 0.0f) {
+        events[event_count++] = pan;
+      }
+      bool control = IsKeyDown(KEY_LEFT_CONTROL) || IsKeyDown(KEY_RIGHT_CONTROL);
+      if (IsKeyPressed(KEY_BACKSPACE) || (control && IsKeyPressed(KEY_Z))) {
+        events[event_count++] = (InputEvent){ .kind = INPUT_UNDO };
+      }
+      if (control && IsKeyPressed(KEY_Y)) {
+        events[event_count++] = (InputEvent){ .kind = INPUT_REDO };
+      }
+    }
+
+    for (int i = 0; i < event_count; ++i) {
+      requested_generation = apply_input(&state, &events[i]);
+      if (events[i].kind == INPUT_UNDO || events[i].kind == INPUT_REDO) {
+        history_generation = requested_generation;
+      }
+      if (replaying) {
+        LatencySample* sample = &replay.samples[replay.next++];
+        sample->generation = requested_generation;
+        sample->input = session_start + events[i].time;
+      }
+      if (record != NULL) {
+        double ms = session_start > 0.0 ? (now - session_start) * 1000.0 : 0.0;
+        fprintf(record, "%.3f %s %.1f %.1f %.3f\n", ms, input_names[events[i].kind],
+                events[i].x, events[i].y, events[i].amount);
+      }
+      redraw = true;
+    }
+
+    if (atomic_load(&state.ready)) {
+      mtx_lock(&state.swap_lock);
+      UpdateTexture(texture, state.front);
+      presented_generation = state.front_generation;
+      view_copy(&presented_view, &state.front_view);
+      atomic_store(&state.ready, false);
+      cnd_signal(&state.uploaded);
+      mtx_unlock(&state.swap_lock);
+      redraw = true;
+    }
+    if (atomic_load(&state.guard_ready)) {
+      mtx_lock(&state.swap_lock);
+      UpdateTexture(guard_texture, state.guard_front);
+      guard_position = state.guard_position;
+      guard_shown = true;
+      atomic_store(&state.guard_ready, false);
+      cnd_signal(&state.uploaded);
+      mtx_unlock(&state.swap_lock);
+      redraw = true;
+    }
+
+    /* Nothing can change on screen without either an input event or a
+     * frame coming out of the pipeline. While a frame is in flight we
+     * poll at the display rate; once the latest view is on screen we
+     * block on input, so an idle viewer does not use any CPU.
+     */
+    bool rendering = presented_generation < requested_generation;
+    if (rendering || replaying) {
+      DisableEventWaiting();
+    } else {
+      EnableEventWaiting();
+      // Whatever woke us up (input, expose, resize) gets a fresh frame.
+      redraw = true;
+    }
+
+    if (redraw) {
+      // Until the frame for the latest view is in, a pan that stays within the margin shows the guard frame.
+      long long dx = state.position.x - guard_position.x;
+      long long dy = state.position.y - guard_position.y;
+      bool from_guard = rendering && guard_shown && state.position.zooms == guard_position.zooms &&
+                        llabs(dx) <= margin_x && llabs(dy) <= margin_y;
+      /* Until the frame for a view that undo or redo went to is in, which
+       * takes a moment if its snapshot was evicted, the frame on screen
+       * stands in for it, moved and scaled to where it lies in that view.
+       */
+      Rectangle history_source, history_dest;
+      bool from_history = !from_guard && rendering && history_generation == requested_generation &&
+                          presented_generation > 0 &&
+                          view_reprojection(&presented_view, &state.view, &history_source, &history_dest);
+      BeginDrawing();
+      ClearBackground(BLACK);
+      if (from_guard) {
+        Rectangle source = { margin_x + dx, margin_y + dy, SCREEN_WIDTH, SCREEN_HEIGHT };
+        DrawTextureRec(guard_texture, source, (Vector2){ 0, 0 }, WHITE);
+      } else if (from_history) {
+        DrawTexturePro(texture, history_source, history_dest, (Vector2){ 0, 0 }, 0.0f, WHITE);
+      } else {
+        DrawTexture(texture, 0, 0, WHITE);
+      }
+      EndDrawing();
+      redraw = false;
+
+      double shown = now_seconds();
+      uint64_t shown_generation = from_guard ? requested_generation : presented_generation;
+      if (session_start == 0.0 && presented_generation > 0) {
+        session_start = shown;
+      }
+      for (int i = 0; i < replay.next; ++i) {
+        LatencySample* sample = &replay.samples[i];
+        if (sample->first_pixels == 0.0) {
+          sample->first_pixels = progress_time(&state, sample->generation);
+        }
+        if (sample->on_screen == 0.0 && sample->generation <= shown_generation) {
+          sample->on_screen = shown;
+        }
+      }
+    } else if (replaying) {
+      WaitTime(0.0005);
+      PollInputEvents();
+    } else {
+      WaitTime(1.0 / refresh_rate);
+      PollInputEvents();
+    }
+
+    if (replaying && replay.next == replay.count && !rendering) {
+      replay_report(&replay);
+      break;
+    }
+  }
+
+  atomic_store(&state.quit, true);
+  mtx_lock(&state.view_lock);
+  cnd_broadcast(&state.view_changed);
+  mtx_unlock(&state.view_lock);
+  mtx_lock(&state.frames.lock);
+  cnd_broadcast(&state.frames.changed);
+  mtx_unlock(&state.frames.lock);
+  mtx_lock(&state.swap_lock);
+  cnd_broadcast(&state.uploaded);
+  mtx_unlock(&state.swap_lock);
+
+  thrd_join(iterate_thr, NULL);
+  thrd_join(colorize_thr, NULL);
+  memory_unregister(&state.frames);
+  memory_unregister(&state.history);
+  pool_destroy(&pool, true);
+  view_clear(&state.view);
+  view_clear(&state.front_view);
+  view_clear(&state.back_view);
+  view_clear(&presented_view);
+  MemFree(state.front);
+  MemFree(state.back);
+  if (guard_size > 0) {
+    UnloadTexture(guard_texture);
+    MemFree(state.guard_front);
+    MemFree(state.guard_back);
+  }
+  memory_release(MEMORY_TEXTURES, 2 * TEXTURE_BUFSIZE + 2 * guard_size);
+
+  for (int i = 0; i < PIPELINE_DEPTH; ++i) {
+    arena_report(&state.frames.slots[i].arena);
+  }
+  memory_report();
+  for (int i = 0; i < PIPELINE_DEPTH; ++i) {
+    arena_free(&state.frames.slots[i].arena);
+    view_clear(&state.frames.slots[i].view);
+  }
+  history_free(&state.history);
+  if (record != NULL) {
+    fclose(record);
+  }
+  if (state.metrics != NULL) {
+    fclose(state.metrics->file);
+  }
+  if (state.shm != NULL) {
+    shm_export_close(state.shm);
+  }
+  free(replay.events);
+  free(replay.samples);
   CloseWindow();
   return 0;
 }